@@ -39,13 +39,17 @@ string get_rc(const string& S){
 const vector<string> fasta_suffixes = {".fasta", ".fna", ".ffn", ".faa", ".frn", ".fa"};
 const vector<string> fastq_suffixes = {".fastq", ".fq"};
 
+bool has_gzip_suffix(const string& filename){
+    return filename.size() >= 3 && filename.substr(filename.size()-3) == ".gz";
+}
+
 FileFormat figure_out_file_format(string filename){
     Format fasta_or_fastq;
     bool gzipped = false;
     string extension;
 
     string gzip_suffix = "";
-    if(filename.size() >= 3 && filename.substr(filename.size()-3) == ".gz"){
+    if(has_gzip_suffix(filename)){
         filename = filename.substr(0, filename.size()-3); // Drop .gz
         gzipped = true;
     }
@@ -11,6 +11,7 @@
 #include <fstream>
 #include <cassert>
 #include <algorithm>
+#include <cstring>
 #include "throwing_streams.hh"
 #include "buffered_streams.hh"
 
@@ -28,6 +29,9 @@ struct FileFormat{
 
 FileFormat figure_out_file_format(string filename);
 
+// True if the filename ends with .gz
+bool has_gzip_suffix(const string& filename);
+
 char get_rc(char c);
 string get_rc(const string& S);
 
@@ -42,6 +46,17 @@ const NullStream &operator<<(NullStream &&os, const T &value) {
 }
 
 
+// A record of a FASTA or FASTQ file, pointing into the buffer of a Reader. The
+// spans are not null-terminated. qual is nullptr for FASTA and otherwise has
+// seq_len quality values.
+struct Record_View{
+    const char* header; // Without the '>' or '@'
+    LL header_len;
+    const char* seq;
+    LL seq_len;
+    const char* qual;
+};
+
 template<typename ifstream_t = Buffered_ifstream<std::ifstream>> // The underlying file stream.
 class Reader {
 
@@ -69,6 +84,7 @@ LL mode;
 LL read_buf_cap;
 LL header_buf_cap;
 LL qual_buf_cap;
+bool upper_case_enabled = true;
 
 public:
 
@@ -78,14 +94,43 @@ public:
 
     void read_first_char_and_sanity_check(){
         
-        char c = 0; stream.get(&c);
+        if(stream.available() == 0) stream.refill();
+        char c = stream.available() > 0 ? stream.data()[0] : 0;
         if(mode == FASTA && c != '>')
             throw runtime_error("ERROR: FASTA file does not start with '>'");
         if(mode == FASTQ && c != '@')
             throw runtime_error("ERROR: FASTQ file does not start with '@'");
 
-        // This leaves the input stream pointer after the first character, but
-        // get_next_read_to_buffer is written such that it's ok.
+        // The first character is not consumed: get_next_read_to_buffer starts
+        // every record at its '>' or '@'.
+    }
+
+    // Returns the offset from stream.data() of the newline that ends the line
+    // starting at offset from, or stream.available() if the last line of the file
+    // has no newline. Refills the stream until the whole line is in the buffer.
+    LL find_line_end(LL from){
+        LL searched = from;
+        while(true){
+            const char* data = stream.data();
+            LL n = stream.available();
+            const char* newline = (const char*)memchr(data + searched, '\n', n - searched);
+            if(newline != nullptr) return newline - data;
+            searched = n;
+            if(!stream.refill()) return n;
+        }
+    }
+
+    // Copies src[0..len) to buf[buf_len..), growing buf as needed, and
+    // null-terminates buf. Returns the new length of the content of buf. src may be
+    // the content of buf itself if buf_len is zero.
+    static LL append(const char* src, LL len, char*& buf, LL& buf_cap, LL buf_len){
+        if(buf_len + len + 1 > buf_cap){ // +1: space for null terminator
+            while(buf_len + len + 1 > buf_cap) buf_cap *= 2;
+            buf = (char*)realloc(buf, buf_cap);
+        }
+        memmove(buf + buf_len, src, len);
+        buf[buf_len + len] = '\0';
+        return buf_len + len;
     }
 
     void init_buffers(){
@@ -101,7 +146,9 @@ public:
 
     // mode should be FASTA_MODE or FASTQ_MODE
     // Note: FASTQ mode does not support multi-line FASTQ
-    Reader(string filename, LL mode) : stream(filename, ios::binary), mode(mode) {
+    // The file is decompressed if the filename ends with .gz, with n_threads
+    // threads if it is in the BGZF format
+    Reader(string filename, LL mode, int64_t n_threads = 1) : stream(filename, ios::binary, has_gzip_suffix(filename), n_threads), mode(mode) {
         if(mode != FASTA && mode != FASTQ)
             throw std::invalid_argument("Unkown sequence format");
         
@@ -111,7 +158,8 @@ public:
 
     // mode should be FASTA_MODE or FASTQ_MODE
     // Note: FASTQ mode does not support multi-line FASTQ
-    Reader(string filename) : stream(filename, ios::binary) {
+    // The file is decompressed if the format says it is gzipped
+    Reader(string filename) : stream(filename, ios::binary, figure_out_file_format(filename).gzipped) {
         SeqIO::FileFormat fileformat = figure_out_file_format(filename);
         if(fileformat.format == FASTA) mode = FASTA;
         else if(fileformat.format == FASTQ) mode = FASTQ;
@@ -125,6 +173,7 @@ public:
     ~Reader(){
         free(read_buf);
         free(header_buf);
+        free(qual_buf);
     }
 
     void rewind_to_start(){
@@ -134,104 +183,124 @@ public:
 
     LL get_mode() const {return mode;}
 
-    // Returns length of read, or zero if no more reads.
-    // The read is null-terminated.
-    // The read is stored in the member pointer `read_buffer`
-    // The header is stored in the member pointer `header buffer`
-    // When called, the read that is currently in the buffer is overwritten
-    LL get_next_read_to_buffer() {
+    // If flag is true, then reads are upper-cased (on by default)
+    void set_upper_case(bool flag){
+        upper_case_enabled = flag;
+    }
+
+    // Finds the next record and returns views to its header, sequence and quality
+    // values straight in the input, without copying them. The views stay valid until
+    // the next call. A record that continues past the end of the buffer is moved to
+    // the start of the buffer together with its continuation. A multi-line FASTA
+    // sequence is joined, and the sequence is upper-cased if upper-casing is
+    // enabled. This happens in place in the buffer, or in read_buf if the file is
+    // memory-mapped. Returns false if there are no more records.
+    bool get_next_record_view(Record_View& record){
         
-        if(stream.eof()){
-            return 0;
+        if(stream.available() == 0 && !stream.refill()){
+            return false;
         }
 
-        int64_t header_length = 0;
+        char* seq_copy = nullptr; // The sequence if it had to be copied to read_buf
         if(mode == FASTA){
-            char c = 0;
-
-            while(c != '\n'){
-                // Make space if needed
-                if(header_length >= header_buf_cap) {
-                    header_buf_cap *= 2;
-                    header_buf = (char*)realloc(header_buf, header_buf_cap);
-                }
-
-                // Read next character to buffer
-                stream.get(&c); 
-                header_buf[header_length++] = c;
-            }
-            header_buf[header_length-1] = '\0'; // Overwrite the newline with a null terminator
-
-            LL buf_pos = 0;
-            while(true){
-                if(!stream.get(&c)) break; // Last read end
-                else {
-                    if(c == '\n') continue;
-                    else if(c == '>') break;
-                    else {
-                        if(buf_pos + 1 >= read_buf_cap) { // +1: space for null terminator
-                            read_buf_cap *= 2;
-                            read_buf = (char*)realloc(read_buf, read_buf_cap);
-                        }
-                        read_buf[buf_pos++] = toupper(c);
+            if(stream.data()[0] != '>') throw std::runtime_error("Error: FASTA record does not start with '>'");
+            LL header_end = find_line_end(0);
+
+            // Join the sequence lines up to the next header at the end of the first one
+            LL pos = header_end + 1; // Start of the next line
+            LL seq_end = pos;
+            LL seq_copy_len = 0;
+            bool line_taken = false; // A sequence line has been added to the record
+            bool copying = false; // The sequence is being joined in read_buf
+            while(pos < stream.available() || (pos == stream.available() && stream.refill())){
+                if(stream.data()[pos] == '>') break;
+                LL line_end = find_line_end(pos);
+                if(stream.is_mapped()){
+                    if(line_taken && !copying){ // Second line: start the copy
+                        seq_copy_len = append(stream.data() + header_end + 1, seq_end - header_end - 1, read_buf, read_buf_cap, 0);
+                        copying = true;
                     }
+                    if(copying) seq_copy_len = append(stream.data() + pos, line_end - pos, read_buf, read_buf_cap, seq_copy_len);
+                    else seq_end = line_end;
+                    line_taken = true;
+                } else{
+                    char* data = stream.writable_data();
+                    if(seq_end != pos) memmove(data + seq_end, data + pos, line_end - pos);
+                    seq_end += line_end - pos;
                 }
+                pos = line_end + 1;
             }
-            if(buf_pos == 0) throw std::runtime_error("Error: empty sequence in FASTA file.");
-            read_buf[buf_pos] = '\0';
-            return buf_pos;
-        } else if(mode == FASTQ){
-            char c = 0;
-            while(c != '\n'){
-                // Make space if needed
-                if(header_length >= header_buf_cap) {
-                    header_buf_cap *= 2;
-                    header_buf = (char*)realloc(header_buf, header_buf_cap);
-                }
 
-                // Read next character to buffer
-                stream.get(&c); 
-                header_buf[header_length++] = c;
-            }
-            header_buf[header_length-1] = '\0'; // Overwrite the newline with a null terminator
-
-            // Read the sequence
-            LL buf_pos = 0;
-            while(true){
-                stream.get(&c);
-                if(c == '\n') break; // End of read
-                if(buf_pos + 1 >= read_buf_cap) { // +1: space for null terminator
-                    read_buf_cap *= 2;
-                    read_buf = (char*)realloc(read_buf, read_buf_cap);
-                }
-                read_buf[buf_pos++] = toupper(c);
-            }
-            read_buf[buf_pos] = '\0';
-
-            c = 0;
-            while(c != '\n') stream.get(&c); // Skip '+'-line
-
-            // Read the quality line
-            c = 0;
-            LL qual_buf_pos = 0;
-            while(true){
-                stream.get(&c);
-                if(c == '\n') break; // End of quality line
-                if(qual_buf_pos + 1 >= qual_buf_cap) { // +1: space for null terminator
-                    qual_buf_cap *= 2;
-                    qual_buf = (char*)realloc(qual_buf, qual_buf_cap);
-                }
-                qual_buf[qual_buf_pos++] = c;
+            const char* data = stream.data();
+            record.header = data + 1;
+            record.header_len = header_end - 1;
+            record.seq = data + header_end + 1;
+            record.seq_len = seq_end - header_end - 1;
+            if(copying){
+                record.seq = seq_copy = read_buf;
+                record.seq_len = seq_copy_len;
             }
-            qual_buf[qual_buf_pos] = '\0';
-
-            stream.get(&c); // Consume the '@' of the next read. If no more reads left, sets the eof flag.
-
-            if(buf_pos == 0) throw std::runtime_error("Error: empty sequence in FASTQ file.");
-            return buf_pos;
+            record.qual = nullptr;
+            if(record.seq_len == 0) throw std::runtime_error("Error: empty sequence in FASTA file.");
+            stream.consume(min(pos, stream.available()));
+        } else if(mode == FASTQ){
+            // Find the four lines of the record
+            if(stream.data()[0] != '@') throw std::runtime_error("Error: FASTQ record does not start with '@'");
+            LL header_end = find_line_end(0);
+            LL seq_end = (header_end < stream.available()) ? find_line_end(header_end + 1) : -1;
+            LL plus_end = (seq_end >= 0 && seq_end < stream.available()) ? find_line_end(seq_end + 1) : -1;
+            LL qual_end = (plus_end >= 0 && plus_end < stream.available()) ? find_line_end(plus_end + 1) : -1;
+            if(qual_end < 0) throw std::runtime_error("Error: truncated FASTQ record.");
+
+            const char* data = stream.data();
+            if(data[seq_end + 1] != '+') throw std::runtime_error("Error: FASTQ record has no '+'-line.");
+            LL seq_len = seq_end - header_end - 1;
+            if(qual_end - plus_end - 1 != seq_len)
+                throw std::runtime_error("Error: FASTQ record has a different number of quality values than bases.");
+            if(seq_len == 0) throw std::runtime_error("Error: empty sequence in FASTQ file.");
+
+            record.header = data + 1;
+            record.header_len = header_end - 1;
+            record.seq = data + header_end + 1;
+            record.seq_len = seq_len;
+            record.qual = data + plus_end + 1;
+            stream.consume(min(qual_end + 1, stream.available()));
         } else{
             throw std::runtime_error("Should not come to this else-branch");
         }
+
+        if(upper_case_enabled){
+            char* seq = seq_copy; // Locals, so that the compiler sees that the loop does not change them
+            LL seq_len = record.seq_len;
+            if(seq == nullptr && stream.is_mapped()){
+                append(record.seq, seq_len, read_buf, read_buf_cap, 0);
+                seq = read_buf;
+            } else if(seq == nullptr) seq = const_cast<char*>(record.seq); // Points to the writable buffer
+            for(LL i = 0; i < seq_len; i++){
+                char c = seq[i];
+                seq[i] = (c >= 'a' && c <= 'z') ? c - 32 : c;
+            }
+            record.seq = seq;
+        }
+        return true;
+    }
+
+    // Returns length of read, or zero if no more reads.
+    // The read is null-terminated.
+    // The read is stored in the member pointer `read_buffer`
+    // The header is stored in the member pointer `header buffer`
+    // When called, the read that is currently in the buffer is overwritten
+    LL get_next_read_to_buffer() {
+        
+        Record_View record;
+        if(!get_next_record_view(record)){
+            return 0;
+        }
+
+        append(record.header, record.header_len, header_buf, header_buf_cap, 0);
+        append(record.seq, record.seq_len, read_buf, read_buf_cap, 0);
+        if(record.qual != nullptr) append(record.qual, record.seq_len, qual_buf, qual_buf_cap, 0);
+        return record.seq_len;
     }
 
     // Slow
@@ -259,7 +328,8 @@ class Writer{
     LL mode;
 
     // Tries to figure out the format based on the file extension.
-    Writer(string filename) : out(filename) {
+    // The output is gzipped if the filename ends with .gz.
+    Writer(string filename) : out(filename, ios::out, figure_out_file_format(filename).gzipped) {
         SeqIO::FileFormat fileformat = figure_out_file_format(filename);
         if(fileformat.format == FASTA) mode = FASTA;
         else if(fileformat.format == FASTQ) mode = FASTQ;
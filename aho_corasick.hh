@@ -25,11 +25,17 @@
 
 #include <algorithm>
 #include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
 #include <map>
 #include <memory>
 #include <set>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <queue>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -297,8 +303,7 @@ namespace aho_corasick {
 		typedef std::unique_ptr<state<CharType>> unique_ptr;
 		typedef std::basic_string<CharType>      string_type;
 		typedef std::basic_string<CharType>&     string_ref_type;
-		typedef std::pair<string_type, unsigned> key_index;
-		typedef std::set<key_index>              string_collection;
+		typedef std::vector<unsigned>            index_collection;
 		typedef std::vector<ptr>                 state_collection;
 		typedef std::vector<CharType>            transition_collection;
 
@@ -307,7 +312,8 @@ namespace aho_corasick {
 		ptr                            d_root;
 		std::map<CharType, unique_ptr> d_success;
 		ptr                            d_failure;
-		string_collection              d_emits;
+		ptr                            d_output;
+		index_collection               d_emits;
 
 	public:
 		state(): state(0) {}
@@ -317,6 +323,7 @@ namespace aho_corasick {
 			, d_root(depth == 0 ? this : nullptr)
 			, d_success()
 			, d_failure(nullptr)
+			, d_output(nullptr)
 			, d_emits() {}
 
 		ptr next_state(CharType character) const {
@@ -338,23 +345,23 @@ namespace aho_corasick {
 
 		size_t get_depth() const { return d_depth; }
 
-		void add_emit(string_ref_type keyword, unsigned index) {
-			d_emits.insert(std::make_pair(keyword, index));
+		void add_emit(unsigned index) {
+			d_emits.push_back(index);
 		}
 
-		void add_emit(const string_collection& emits) {
-			for (const auto& e : emits) {
-				string_type str(e.first);
-				add_emit(str, e.second);
-			}
-		}
-
-		string_collection get_emits() const { return d_emits; }
+		// Indices of the keywords that end exactly at this state. The keywords
+		// that are proper suffixes of this state are found through output().
+		const index_collection& get_emits() const { return d_emits; }
 
 		ptr failure() const { return d_failure; }
 
 		void set_failure(ptr fail_state) { d_failure = fail_state; }
 
+		// The nearest state on the failure chain that has emits, or nullptr.
+		ptr output() const { return d_output; }
+
+		void set_output(ptr output_state) { d_output = output_state; }
+
 		state_collection get_states() const {
 			state_collection result;
 			for (auto it = d_success.cbegin(); it != d_success.cend(); ++it) {
@@ -423,6 +430,7 @@ namespace aho_corasick {
 		config                      d_config;
 		bool                        d_constructed_failure_states;
 		unsigned                    d_num_keywords = 0;
+		std::vector<string_type>    d_keywords;
 
 	public:
 		basic_trie(): basic_trie(config()) {}
@@ -454,10 +462,19 @@ namespace aho_corasick {
 			for (const auto& ch : keyword) {
 				cur_state = cur_state->add_state(ch);
 			}
-			cur_state->add_emit(keyword, d_num_keywords++);
+			cur_state->add_emit(d_num_keywords++);
+			d_keywords.push_back(keyword);
 			d_constructed_failure_states = false;
 		}
 
+		unsigned num_keywords() const { return d_num_keywords; }
+
+		const string_type& get_keyword(unsigned index) const { return d_keywords[index]; }
+
+		const std::vector<string_type>& get_keywords() const { return d_keywords; }
+
+		const config& get_config() const { return d_config; }
+
 		template<class InputIterator>
 		void insert(InputIterator first, InputIterator last) {
 			for (InputIterator it = first; first != last; ++it) {
@@ -576,25 +593,740 @@ namespace aho_corasick {
 					}
 					state_ptr_type new_failure_state = trace_failure_state->next_state(transition);
 					target_state->set_failure(new_failure_state);
-					target_state->add_emit(new_failure_state->get_emits());
+					target_state->set_output(new_failure_state->get_emits().empty() ? new_failure_state->output() : new_failure_state);
 				}
 				q.pop();
 			}
 		}
 
 		void store_emits(size_t pos, state_ptr_type cur_state, emit_collection& collected_emits) const {
-			auto emits = cur_state->get_emits();
-			if (!emits.empty()) {
-				for (const auto& str : emits) {
-					auto emit_str = typename emit_type::string_type(str.first);
-					collected_emits.push_back(emit_type(pos - emit_str.size() + 1, pos, emit_str, str.second));
+			for (state_ptr_type s = cur_state; s != nullptr; s = s->output()) {
+				for (unsigned index : s->get_emits()) {
+					const string_type& keyword = d_keywords[index];
+					collected_emits.push_back(emit_type(pos - keyword.size() + 1, pos, keyword, index));
 				}
 			}
 		}
 	};
 
+	namespace detail {
+
+		// Runs f(begin, end) on consecutive chunks of [0, n), one per thread.
+		template<typename F>
+		void parallel_for(size_t n, unsigned num_threads, F f) {
+			if (num_threads <= 1 || n < 4096) {
+				f(size_t(0), n);
+				return;
+			}
+			std::vector<std::thread> threads;
+			size_t chunk = (n + num_threads - 1) / num_threads;
+			for (size_t begin = 0; begin < n; begin += chunk) {
+				threads.emplace_back(f, begin, std::min(n, begin + chunk));
+			}
+			for (auto& t : threads) t.join();
+		}
+
+		inline bool get_bit(const std::vector<uint64_t>& bits, size_t i) { return (bits[i / 64] >> (i % 64)) & 1; }
+
+		inline void set_bit(std::vector<uint64_t>& bits, size_t i) { bits[i / 64] |= uint64_t(1) << (i % 64); }
+
+		// Fills the byte-to-symbol table of a compiled automaton and returns the
+		// number of symbols. The characters that occur in the keywords get symbols
+		// in increasing order. All other bytes share the last symbol, which never
+		// has a goto transition. If case_insensitive, both cases of a letter map to
+		// the same symbol.
+		template<typename string_type>
+		uint32_t build_symbol_table(const std::vector<string_type>& keywords, bool case_insensitive, uint8_t symbol[256]) {
+			auto fold = [case_insensitive](unsigned char c) -> unsigned char {
+				return case_insensitive ? std::tolower(c) : c;
+			};
+			bool in_alphabet[256] = {};
+			for (const auto& keyword : keywords) {
+				for (auto c : keyword) in_alphabet[fold(c)] = true;
+			}
+			uint8_t symbol_of_folded[256];
+			uint32_t alphabet_size = 0;
+			for (unsigned c = 0; c < 256; ++c) {
+				if (in_alphabet[c]) symbol_of_folded[c] = alphabet_size++;
+			}
+			uint32_t num_symbols = alphabet_size < 256 ? alphabet_size + 1 : 256;
+			for (unsigned c = 0; c < 256; ++c) {
+				symbol[c] = in_alphabet[fold(c)] ? symbol_of_folded[fold(c)] : num_symbols - 1;
+			}
+			return num_symbols;
+		}
+
+		// Length of the longest common prefix of two keywords, compared by symbol
+		template<typename string_type>
+		size_t common_prefix(const string_type& a, const string_type& b, const uint8_t symbol[256]) {
+			size_t n = std::min(a.size(), b.size());
+			size_t i = 0;
+			while (i < n && symbol[static_cast<unsigned char>(a[i])] == symbol[static_cast<unsigned char>(b[i])]) i++;
+			return i;
+		}
+
+		// Returns the indices of the non-empty keywords sorted by their symbol
+		// strings, so that the keywords below each trie node form a contiguous
+		// range. Equal keywords are ordered by index.
+		template<typename string_type>
+		std::vector<uint32_t> sort_keywords(const std::vector<string_type>& keywords, const uint8_t symbol[256]) {
+			std::vector<uint32_t> order;
+			for (uint32_t k = 0; k < keywords.size(); ++k) {
+				if (!keywords[k].empty()) order.push_back(k);
+			}
+			std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+				const string_type& x = keywords[a];
+				const string_type& y = keywords[b];
+				size_t i = common_prefix(x, y, symbol);
+				if (i < x.size() && i < y.size()) {
+					return symbol[static_cast<unsigned char>(x[i])] < symbol[static_cast<unsigned char>(y[i])];
+				}
+				if (x.size() != y.size()) return x.size() < y.size();
+				return a < b;
+			});
+			return order;
+		}
+
+	} // namespace detail
+
+	// class basic_dfa
+	// A compiled, read-only Aho-Corasick automaton. The goto function and the
+	// failure links are folded into one dense transition table, so scanning costs
+	// one indexed load per character. Input bytes are first mapped through a
+	// 256-entry table to a compressed alphabet holding the characters that occur
+	// in the keywords, plus one symbol for all other bytes. If case insensitive,
+	// both cases of a letter map to the same symbol. Only byte-sized characters
+	// are supported. All matches are reported, like basic_trie does with its
+	// default config.
+	//
+	// The automaton is built straight from the keyword list: the keywords are
+	// sorted, the trie is laid out one depth at a time in flat arrays, and the
+	// failure links of each depth are computed in parallel. All tables live in
+	// one flat block of memory, which can be written to a file with data() and
+	// size() and later used in place, e.g. from a read-only mmap.
+	template<typename CharType>
+	class basic_dfa {
+		static_assert(sizeof(CharType) == 1, "basic_dfa only supports byte-sized characters");
+
+	public:
+		using string_type = std::basic_string<CharType>;
+
+		typedef uint32_t                state_id; // Offset of the row of the state in the transition table
+		typedef basic_trie<CharType>    trie_type;
+		typedef emit<CharType>          emit_type;
+		typedef std::vector<emit_type>  emit_collection;
+
+		static constexpr state_id ROOT = 0;
+		static constexpr uint32_t NO_OUTPUT = UINT32_MAX;
+
+	private:
+		// Header of the block. The arrays follow in the order of the pointers
+		// below, each starting at an 8-byte boundary.
+		//
+		// States with output are numbered last, so a state has output iff its row
+		// starts at first_output or later. The output states are indexed from zero
+		// in d_emit_begin and d_output_link. Keywords ending exactly at output
+		// state j are d_emit_ids[d_emit_begin[j]..d_emit_begin[j+1]), and the rest
+		// are found by following d_output_link.
+		struct header {
+			uint32_t num_symbols;
+			uint32_t num_states;
+			uint32_t first_output;
+			uint32_t num_output_states;
+			uint32_t num_emit_ids;
+			uint32_t num_keywords;
+			uint64_t num_keyword_chars;
+		};
+
+		std::shared_ptr<const void> d_memory; // Owns the block the pointers below point into
+		size_t                      d_size;
+		uint32_t                    d_num_symbols;
+		uint32_t                    d_num_states;
+		state_id                    d_first_output;
+		uint32_t                    d_num_keywords;
+		const uint8_t*              d_symbol;        // Byte to symbol
+		const state_id*             d_delta;         // Row of state number i starts at i * d_num_symbols
+		const uint32_t*             d_emit_begin;
+		const uint32_t*             d_output_link;
+		const uint32_t*             d_emit_ids;
+		const uint64_t*             d_keyword_begin; // Keyword i is d_keyword_chars[d_keyword_begin[i]..d_keyword_begin[i+1])
+		const CharType*             d_keyword_chars;
+
+		static size_t padded(size_t bytes) { return (bytes + 7) & ~size_t(7); }
+
+	public:
+		explicit basic_dfa(const trie_type& t)
+			: basic_dfa(t.get_keywords(), t.get_config().is_case_insensitive()) {}
+
+		// Keyword indices are positions in keywords. Empty keywords are ignored.
+		// Construction uses up to num_threads threads.
+		explicit basic_dfa(const std::vector<string_type>& keywords, bool case_insensitive = false, unsigned num_threads = 1) {
+			build(keywords, case_insensitive, num_threads);
+		}
+
+		// Uses a block earlier obtained from data() in place. The block must be
+		// 8-byte aligned, and memory must keep it alive.
+		basic_dfa(std::shared_ptr<const void> memory, size_t size) {
+			attach(memory, size);
+		}
+
+		const void* data() const { return d_memory.get(); }
+
+		size_t size() const { return d_size; }
+
+		size_t num_states() const { return d_num_states; }
+
+		size_t num_symbols() const { return d_num_symbols; }
+
+		size_t num_keywords() const { return d_num_keywords; }
+
+		state_id next_state(state_id s, CharType c) const {
+			return d_delta[s + d_symbol[static_cast<unsigned char>(c)]];
+		}
+
+		bool has_output(state_id s) const { return s >= d_first_output; }
+
+		string_type get_keyword(uint32_t index) const {
+			return string_type(d_keyword_chars + d_keyword_begin[index], d_keyword_chars + d_keyword_begin[index + 1]);
+		}
+
+		// Calls visit(keyword_index, end_pos) for every keyword occurrence in
+		// text[0..len), in order of end position. Does not allocate.
+		template<typename Visitor>
+		void scan(const CharType* text, size_t len, Visitor&& visit) const {
+			state_id cur_state = ROOT;
+			for (size_t pos = 0; pos < len; ++pos) {
+				cur_state = next_state(cur_state, text[pos]);
+				if (has_output(cur_state)) {
+					uint32_t j = (cur_state - d_first_output) / d_num_symbols;
+					do {
+						for (uint32_t i = d_emit_begin[j]; i < d_emit_begin[j + 1]; ++i) {
+							visit(d_emit_ids[i], pos);
+						}
+						j = d_output_link[j];
+					} while (j != NO_OUTPUT);
+				}
+			}
+		}
+
+		// Returns true iff some keyword occurs in text[0..len). Stops at the
+		// first state with output, so no emits are looked at.
+		bool contains_any(const CharType* text, size_t len) const {
+			state_id cur_state = ROOT;
+			for (size_t pos = 0; pos < len; ++pos) {
+				cur_state = next_state(cur_state, text[pos]);
+				if (has_output(cur_state)) return true;
+			}
+			return false;
+		}
+
+		emit_collection parse_text(const string_type& text) const {
+			emit_collection collected_emits;
+			scan(text.data(), text.size(), [&](uint32_t index, size_t pos) {
+				size_t keyword_len = d_keyword_begin[index + 1] - d_keyword_begin[index];
+				collected_emits.push_back(emit_type(pos - keyword_len + 1, pos, get_keyword(index), index));
+			});
+			return collected_emits;
+		}
+
+	private:
+		void attach(std::shared_ptr<const void> memory, size_t size) {
+			const char* p = static_cast<const char*>(memory.get());
+			const char* end = p + size;
+			auto take = [&p, end](size_t bytes) {
+				if (padded(bytes) > size_t(end - p)) {
+					throw std::runtime_error("Truncated Aho-Corasick automaton");
+				}
+				const char* result = p;
+				p += padded(bytes);
+				return result;
+			};
+			const header* h = reinterpret_cast<const header*>(take(sizeof(header)));
+			d_memory = memory;
+			d_size = size;
+			d_num_symbols = h->num_symbols;
+			d_num_states = h->num_states;
+			d_first_output = h->first_output;
+			d_num_keywords = h->num_keywords;
+			d_symbol = reinterpret_cast<const uint8_t*>(take(256));
+			d_delta = reinterpret_cast<const state_id*>(take(size_t(h->num_states) * h->num_symbols * sizeof(state_id)));
+			d_emit_begin = reinterpret_cast<const uint32_t*>(take((h->num_output_states + size_t(1)) * sizeof(uint32_t)));
+			d_output_link = reinterpret_cast<const uint32_t*>(take(h->num_output_states * sizeof(uint32_t)));
+			d_emit_ids = reinterpret_cast<const uint32_t*>(take(h->num_emit_ids * sizeof(uint32_t)));
+			d_keyword_begin = reinterpret_cast<const uint64_t*>(take((h->num_keywords + size_t(1)) * sizeof(uint64_t)));
+			d_keyword_chars = reinterpret_cast<const CharType*>(take(h->num_keyword_chars));
+		}
+
+		void build(const std::vector<string_type>& keywords, bool case_insensitive, unsigned num_threads) {
+			using detail::get_bit;
+			using detail::set_bit;
+			static constexpr uint32_t NONE = UINT32_MAX;
+
+			uint8_t symbol[256];
+			const uint32_t S = detail::build_symbol_table(keywords, case_insensitive, symbol);
+			auto symbol_at = [&](uint32_t k, size_t i) { return symbol[static_cast<unsigned char>(keywords[k][i])]; };
+
+			// Count the trie nodes from the common prefixes of the sorted keywords
+			std::vector<uint32_t> order = detail::sort_keywords(keywords, symbol);
+			uint64_t num_states = 1;
+			for (size_t i = 0; i < order.size(); ++i) {
+				num_states += keywords[order[i]].size() - (i == 0 ? 0 : detail::common_prefix(keywords[order[i - 1]], keywords[order[i]], symbol));
+			}
+			if (num_states * S > UINT32_MAX) {
+				throw std::length_error("Too many states in the Aho-Corasick automaton");
+			}
+			const uint32_t N = num_states;
+
+			// The transition table is built in place in the final block. Other
+			// per-state data is kept to a few bits and one link per state.
+			size_t delta_begin = padded(sizeof(header)) + padded(256);
+			size_t size = delta_begin + padded(size_t(N) * S * sizeof(state_id));
+			char* block = static_cast<char*>(std::malloc(size));
+			if (block == nullptr) throw std::bad_alloc();
+			state_id* delta = reinterpret_cast<state_id*>(block + delta_begin);
+			std::fill(delta, delta + size_t(N) * S, NONE);
+			std::fill(reinterpret_cast<char*>(delta + size_t(N) * S), block + size, 0);
+			std::vector<uint32_t> output(N, NONE);
+			std::vector<uint64_t> terminal((N + 63) / 64);
+			std::vector<uint32_t> emit_ids;
+			std::vector<uint32_t> terminal_emit_begin(1, 0);
+
+			// Lay out the trie one depth at a time. Node i of the current depth covers
+			// the keywords order[lo[i]..hi[i]) and was reached from node parent[i] of
+			// the previous depth with symbol sym[i]. Once the children of a depth are
+			// known, the failure links and the missing transitions of that depth are
+			// filled in from shallower rows, which are complete, so the nodes of one
+			// depth are independent and are processed in parallel.
+			std::vector<uint32_t> lo(1, 0), hi(1, order.size()), parent(1, 0), fail, prev_fail;
+			std::vector<uint8_t> sym(1, 0);
+			std::vector<uint32_t> next_lo, next_hi, next_parent;
+			std::vector<uint8_t> next_sym;
+			uint32_t level_begin = 0;
+			uint32_t next_number = 1;
+			for (size_t depth = 0; !lo.empty(); ++depth) {
+				next_lo.clear(); next_hi.clear(); next_parent.clear(); next_sym.clear();
+				for (uint32_t i = 0; i < lo.size(); ++i) {
+					uint32_t node = level_begin + i;
+					uint32_t j = lo[i];
+					while (j < hi[i] && keywords[order[j]].size() == depth) emit_ids.push_back(order[j++]);
+					if (j != lo[i]) {
+						set_bit(terminal, node);
+						terminal_emit_begin.push_back(emit_ids.size());
+					}
+					while (j < hi[i]) {
+						uint8_t c = symbol_at(order[j], depth);
+						uint32_t k = j + 1;
+						while (k < hi[i] && symbol_at(order[k], depth) == c) k++;
+						delta[size_t(node) * S + c] = next_number++;
+						next_lo.push_back(j); next_hi.push_back(k); next_parent.push_back(i); next_sym.push_back(c);
+						j = k;
+					}
+				}
+
+				fail.resize(lo.size());
+				detail::parallel_for(lo.size(), num_threads, [&](size_t begin, size_t end) {
+					for (size_t i = begin; i < end; ++i) {
+						uint32_t node = level_begin + i;
+						uint32_t f = 0;
+						if (depth > 1) f = delta[size_t(prev_fail[parent[i]]) * S + sym[i]];
+						fail[i] = f;
+						if (depth > 0) output[node] = get_bit(terminal, f) ? f : output[f];
+						state_id* row = delta + size_t(node) * S;
+						const state_id* failure_row = delta + size_t(f) * S;
+						for (uint32_t a = 0; a < S; ++a) {
+							if (row[a] == NONE) row[a] = (depth == 0 ? 0 : failure_row[a]);
+						}
+					}
+				});
+
+				level_begin += lo.size();
+				lo.swap(next_lo); hi.swap(next_hi); parent.swap(next_parent); sym.swap(next_sym);
+				prev_fail.swap(fail);
+			}
+			std::vector<uint32_t>().swap(prev_fail);
+			std::vector<uint32_t>().swap(fail);
+
+			// Renumber the states so that the states with output come last, keeping
+			// the BFS order within both groups. The new number of a state is computed
+			// from the ranks of an output bit vector.
+			std::vector<uint64_t> is_output((N + 63) / 64);
+			for (uint32_t v = 0; v < N; ++v) {
+				if (get_bit(terminal, v) || output[v] != NONE) set_bit(is_output, v);
+			}
+			std::vector<uint32_t> rank(is_output.size() + 1, 0);
+			for (size_t w = 0; w < is_output.size(); ++w) {
+				rank[w + 1] = rank[w] + __builtin_popcountll(is_output[w]);
+			}
+			const uint32_t num_output_states = rank.back();
+			const uint32_t first_output_number = N - num_output_states;
+			auto new_number = [&](uint32_t v) -> uint32_t {
+				uint32_t ones = rank[v / 64] + __builtin_popcountll(is_output[v / 64] & ((uint64_t(1) << (v % 64)) - 1));
+				return get_bit(is_output, v) ? first_output_number + ones : v - ones;
+			};
+
+			detail::parallel_for(size_t(N) * S, num_threads, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i) delta[i] = new_number(delta[i]) * S;
+			});
+			std::vector<uint64_t> moved((N + 63) / 64);
+			std::vector<state_id> carried(S), displaced(S);
+			for (uint32_t v = 0; v < N; ++v) {
+				if (get_bit(moved, v) || new_number(v) == v) continue;
+				std::copy_n(delta + size_t(v) * S, S, carried.begin());
+				uint32_t u = v;
+				do {
+					u = new_number(u);
+					std::copy_n(delta + size_t(u) * S, S, displaced.begin());
+					std::copy_n(carried.begin(), S, delta + size_t(u) * S);
+					carried.swap(displaced);
+					set_bit(moved, u);
+				} while (u != v);
+			}
+
+			std::vector<uint32_t> emit_begin(1, 0), output_link;
+			size_t terminal_rank = 0;
+			for (uint32_t v = 0; v < N; ++v) {
+				if (!get_bit(is_output, v)) continue;
+				if (get_bit(terminal, v)) terminal_rank++;
+				emit_begin.push_back(terminal_emit_begin[terminal_rank]);
+				output_link.push_back(output[v] == NONE ? NO_OUTPUT : new_number(output[v]) - first_output_number);
+			}
+			std::vector<uint32_t>().swap(output);
+
+			// Append the emit and keyword arrays to the block
+			header h;
+			h.num_symbols = S;
+			h.num_states = N;
+			h.first_output = first_output_number * S;
+			h.num_output_states = num_output_states;
+			h.num_emit_ids = emit_ids.size();
+			h.num_keywords = keywords.size();
+			h.num_keyword_chars = 0;
+			std::vector<uint64_t> keyword_begin(1, 0);
+			for (const auto& keyword : keywords) {
+				h.num_keyword_chars += keyword.size();
+				keyword_begin.push_back(h.num_keyword_chars);
+			}
+			size_t tail_begin = size;
+			size += padded(emit_begin.size() * sizeof(uint32_t))
+				+ padded(output_link.size() * sizeof(uint32_t))
+				+ padded(emit_ids.size() * sizeof(uint32_t))
+				+ padded(keyword_begin.size() * sizeof(uint64_t))
+				+ padded(h.num_keyword_chars);
+			char* grown = static_cast<char*>(std::realloc(block, size));
+			if (grown == nullptr) {
+				std::free(block);
+				throw std::bad_alloc();
+			}
+			block = grown;
+			std::shared_ptr<void> memory(block, std::free);
+
+			auto put = [](char*& p, const void* src, size_t bytes) {
+				std::copy_n(static_cast<const char*>(src), bytes, p);
+				std::fill(p + bytes, p + padded(bytes), 0);
+				p += padded(bytes);
+			};
+			char* p = block;
+			put(p, &h, sizeof(header));
+			put(p, symbol, 256);
+			p = block + tail_begin;
+			put(p, emit_begin.data(), emit_begin.size() * sizeof(uint32_t));
+			put(p, output_link.data(), output_link.size() * sizeof(uint32_t));
+			put(p, emit_ids.data(), emit_ids.size() * sizeof(uint32_t));
+			put(p, keyword_begin.data(), keyword_begin.size() * sizeof(uint64_t));
+			for (const auto& keyword : keywords) {
+				std::copy(keyword.begin(), keyword.end(), p);
+				p += keyword.size();
+			}
+			std::fill(p, block + size, 0);
+			attach(memory, size);
+		}
+	};
+
+	// class basic_double_array
+	// An Aho-Corasick automaton stored as a double-array trie with failure links,
+	// for keyword sets too large for the dense table of basic_dfa. A state is a
+	// 12-byte slot with 32-bit links, and the slots of the children of a state
+	// are interleaved with other states, so the automaton takes little more
+	// than 12 bytes per state for any alphabet. Missing transitions follow the
+	// failure links, so scanning is slower per character than with basic_dfa.
+	// Takes the same keywords and reports the same matches as basic_dfa.
+	template<typename CharType>
+	class basic_double_array {
+		static_assert(sizeof(CharType) == 1, "basic_double_array only supports byte-sized characters");
+
+	public:
+		using string_type = std::basic_string<CharType>;
+
+		typedef uint32_t                state_id; // Slot of the state
+		typedef emit<CharType>          emit_type;
+		typedef std::vector<emit_type>  emit_collection;
+
+		static constexpr state_id ROOT = 0;
+		static constexpr uint32_t NO_OUTPUT = UINT32_MAX;
+
+	private:
+		static constexpr uint32_t NONE = UINT32_MAX;
+		static constexpr uint32_t OUTPUT_FLAG = uint32_t(1) << 31;
+
+		// The child of the state in slot s with symbol a is in slot base + a if
+		// the check of that slot is s. The failure field holds the slot of the
+		// failure state, with OUTPUT_FLAG set if the state has output.
+		struct slot {
+			uint32_t base;
+			uint32_t check;
+			uint32_t failure;
+		};
+
+		uint8_t               d_symbol[256]; // Byte to symbol
+		uint32_t              d_num_symbols;
+		uint32_t              d_num_states;
+		std::vector<slot>     d_slots;
+
+		// The output states are indexed by their rank among the output slots. The
+		// emits are laid out like in basic_dfa.
+		std::vector<uint64_t> d_output_bits;
+		std::vector<uint32_t> d_output_rank; // Number of output slots before each 64-slot block
+		std::vector<uint32_t> d_emit_begin;
+		std::vector<uint32_t> d_output_link;
+		std::vector<uint32_t> d_emit_ids;
+		std::vector<uint64_t> d_keyword_begin;
+		string_type           d_keyword_chars;
+
+	public:
+		// Keyword indices are positions in keywords. Empty keywords are ignored.
+		// Construction uses up to num_threads threads.
+		explicit basic_double_array(const std::vector<string_type>& keywords, bool case_insensitive = false, unsigned num_threads = 1) {
+			build(keywords, case_insensitive, num_threads);
+		}
+
+		size_t num_states() const { return d_num_states; }
+
+		size_t num_slots() const { return d_slots.size(); }
+
+		size_t num_symbols() const { return d_num_symbols; }
+
+		size_t num_keywords() const { return d_keyword_begin.size() - 1; }
+
+		// Size of the automaton in bytes
+		size_t size() const {
+			return d_slots.size() * sizeof(slot) + d_output_bits.size() * sizeof(uint64_t)
+				+ (d_output_rank.size() + d_emit_begin.size() + d_output_link.size() + d_emit_ids.size()) * sizeof(uint32_t)
+				+ d_keyword_begin.size() * sizeof(uint64_t) + d_keyword_chars.size();
+		}
+
+		state_id next_state(state_id s, CharType c) const {
+			uint32_t a = d_symbol[static_cast<unsigned char>(c)];
+			while (true) {
+				state_id t = d_slots[s].base + a;
+				if (d_slots[t].check == s) return t;
+				if (s == ROOT) return ROOT;
+				s = d_slots[s].failure & ~OUTPUT_FLAG;
+			}
+		}
+
+		bool has_output(state_id s) const { return d_slots[s].failure & OUTPUT_FLAG; }
+
+		string_type get_keyword(uint32_t index) const {
+			return d_keyword_chars.substr(d_keyword_begin[index], d_keyword_begin[index + 1] - d_keyword_begin[index]);
+		}
+
+		// Calls visit(keyword_index, end_pos) for every keyword occurrence in
+		// text[0..len), in order of end position. Does not allocate.
+		template<typename Visitor>
+		void scan(const CharType* text, size_t len, Visitor&& visit) const {
+			state_id cur_state = ROOT;
+			for (size_t pos = 0; pos < len; ++pos) {
+				cur_state = next_state(cur_state, text[pos]);
+				if (has_output(cur_state)) {
+					uint32_t j = output_rank(cur_state);
+					do {
+						for (uint32_t i = d_emit_begin[j]; i < d_emit_begin[j + 1]; ++i) {
+							visit(d_emit_ids[i], pos);
+						}
+						j = d_output_link[j];
+					} while (j != NO_OUTPUT);
+				}
+			}
+		}
+
+		// Returns true iff some keyword occurs in text[0..len)
+		bool contains_any(const CharType* text, size_t len) const {
+			state_id cur_state = ROOT;
+			for (size_t pos = 0; pos < len; ++pos) {
+				cur_state = next_state(cur_state, text[pos]);
+				if (has_output(cur_state)) return true;
+			}
+			return false;
+		}
+
+		emit_collection parse_text(const string_type& text) const {
+			emit_collection collected_emits;
+			scan(text.data(), text.size(), [&](uint32_t index, size_t pos) {
+				size_t keyword_len = d_keyword_begin[index + 1] - d_keyword_begin[index];
+				collected_emits.push_back(emit_type(pos - keyword_len + 1, pos, get_keyword(index), index));
+			});
+			return collected_emits;
+		}
+
+	private:
+		uint32_t output_rank(state_id s) const {
+			uint64_t before = d_output_bits[s / 64] & ((uint64_t(1) << (s % 64)) - 1);
+			return d_output_rank[s / 64] + __builtin_popcountll(before);
+		}
+
+		void build(const std::vector<string_type>& keywords, bool case_insensitive, unsigned num_threads) {
+			using detail::get_bit;
+			using detail::set_bit;
+
+			const uint32_t S = detail::build_symbol_table(keywords, case_insensitive, d_symbol);
+			d_num_symbols = S;
+			auto symbol_at = [&](uint32_t k, size_t i) { return d_symbol[static_cast<unsigned char>(keywords[k][i])]; };
+			std::vector<uint32_t> order = detail::sort_keywords(keywords, d_symbol);
+
+			// Slots are claimed from a bit vector of used slots. States with one child
+			// take the lowest free slot. The search for states with more children
+			// starts at multi_check, which is moved forward when the search gets long,
+			// so that regions with only single holes left are not scanned again.
+			std::vector<uint64_t> used;
+			size_t first_free = 1, multi_check = 1;
+			auto claim = [&](size_t i) {
+				if (i >= d_slots.size()) {
+					d_slots.resize(i + 1, slot{0, NONE, 0});
+					used.resize((d_slots.size() + 63) / 64, 0);
+				}
+				set_bit(used, i);
+			};
+			auto is_free = [&](size_t i) { return i >= d_slots.size() || !get_bit(used, i); };
+			auto next_free = [&](size_t i) {
+				while (!is_free(i)) {
+					if (i % 64 == 0 && used[i / 64] == ~uint64_t(0)) i += 64;
+					else i++;
+				}
+				return i;
+			};
+			std::vector<uint8_t> children;
+			auto find_base = [&]() -> uint32_t {
+				first_free = next_free(first_free);
+				bool single = children.size() == 1;
+				size_t p = std::max<size_t>(single ? first_free : std::max(first_free, multi_check), children[0]);
+				for (size_t tries = 1; ; ++tries, ++p) {
+					p = next_free(p);
+					size_t b = p - children[0];
+					bool fits = true;
+					for (size_t i = 1; i < children.size() && fits; ++i) fits = is_free(b + children[i]);
+					if (!fits) continue;
+					if (!single && tries > 64) multi_check = p;
+					return b;
+				}
+			};
+			claim(ROOT);
+
+			// Lay out the trie in BFS order, remembering the slot, the parent slot and
+			// the incoming symbol of every state and where each depth starts.
+			std::vector<uint32_t> bfs_slot(1, ROOT), bfs_parent(1, ROOT), level_begin(1, 0);
+			std::vector<uint8_t> bfs_symbol(1, 0);
+			std::vector<uint32_t> lo(1, 0), hi(1, order.size());
+			std::vector<uint32_t> next_lo, next_hi;
+			std::vector<uint32_t> terminal_slots;
+			std::vector<uint32_t> terminal_emit_begin(1, 0);
+			std::vector<uint32_t> own_emit_ids;
+			for (size_t depth = 0; level_begin.back() < bfs_slot.size(); ++depth) {
+				uint32_t begin = level_begin.back();
+				uint32_t end = bfs_slot.size();
+				next_lo.clear(); next_hi.clear();
+				for (uint32_t v = begin; v < end; ++v) {
+					uint32_t s = bfs_slot[v];
+					uint32_t i = lo[v - begin];
+					uint32_t stop = hi[v - begin];
+					while (i < stop && keywords[order[i]].size() == depth) own_emit_ids.push_back(order[i++]);
+					if (i != lo[v - begin]) {
+						terminal_slots.push_back(s);
+						terminal_emit_begin.push_back(own_emit_ids.size());
+					}
+					children.clear();
+					for (uint32_t j = i; j < stop; ) {
+						uint8_t c = symbol_at(order[j], depth);
+						uint32_t k = j + 1;
+						while (k < stop && symbol_at(order[k], depth) == c) k++;
+						children.push_back(c);
+						next_lo.push_back(j); next_hi.push_back(k);
+						j = k;
+					}
+					if (children.empty()) continue;
+					uint32_t b = find_base();
+					if (b + S >= OUTPUT_FLAG) throw std::length_error("Too many states in the double-array trie");
+					d_slots[s].base = b;
+					for (uint8_t c : children) {
+						claim(b + c);
+						d_slots[b + c].check = s;
+						bfs_slot.push_back(b + c); bfs_parent.push_back(s); bfs_symbol.push_back(c);
+					}
+				}
+				level_begin.push_back(end);
+				lo.swap(next_lo); hi.swap(next_hi);
+			}
+			d_num_states = bfs_slot.size();
+			d_slots.resize(d_slots.size() + S, slot{0, NONE, 0}); // Transitions from any base stay inside the array
+			d_slots.shrink_to_fit();
+
+			// Failure and output links, one depth at a time. The links of a state only
+			// depend on shallower states, so the states of one depth are processed in
+			// parallel.
+			std::vector<uint64_t> terminal((d_slots.size() + 63) / 64);
+			for (uint32_t s : terminal_slots) set_bit(terminal, s);
+			std::vector<uint32_t> output(d_slots.size(), NONE);
+			for (size_t depth = 1; depth + 1 < level_begin.size(); ++depth) {
+				detail::parallel_for(level_begin[depth + 1] - level_begin[depth], num_threads, [&](size_t begin, size_t end) {
+					for (size_t v = level_begin[depth] + begin; v < level_begin[depth] + end; ++v) {
+						uint32_t f = ROOT;
+						if (depth > 1) {
+							uint32_t a = bfs_symbol[v];
+							f = d_slots[bfs_parent[v]].failure;
+							while (d_slots[d_slots[f].base + a].check != f && f != ROOT) f = d_slots[f].failure;
+							if (d_slots[d_slots[f].base + a].check == f) f = d_slots[f].base + a;
+						}
+						d_slots[bfs_slot[v]].failure = f;
+						output[bfs_slot[v]] = get_bit(terminal, f) ? f : output[f];
+					}
+				});
+			}
+
+			// Flag the output states and index their emits by output rank
+			d_output_bits.assign((d_slots.size() + 63) / 64, 0);
+			for (uint32_t v = 0; v < d_num_states; ++v) {
+				uint32_t s = bfs_slot[v];
+				if (get_bit(terminal, s) || output[s] != NONE) set_bit(d_output_bits, s);
+			}
+			d_output_rank.assign(d_output_bits.size() + 1, 0);
+			for (size_t w = 0; w < d_output_bits.size(); ++w) {
+				d_output_rank[w + 1] = d_output_rank[w] + __builtin_popcountll(d_output_bits[w]);
+			}
+			std::vector<uint32_t> terminal_index(d_slots.size(), NONE);
+			for (uint32_t t = 0; t < terminal_slots.size(); ++t) terminal_index[terminal_slots[t]] = t;
+			d_emit_begin.push_back(0);
+			for (uint32_t s = 0; s < d_slots.size(); ++s) {
+				if (!get_bit(d_output_bits, s)) continue;
+				d_slots[s].failure |= OUTPUT_FLAG;
+				uint32_t t = terminal_index[s];
+				if (t != NONE) {
+					d_emit_ids.insert(d_emit_ids.end(), own_emit_ids.begin() + terminal_emit_begin[t], own_emit_ids.begin() + terminal_emit_begin[t + 1]);
+				}
+				d_emit_begin.push_back(d_emit_ids.size());
+				d_output_link.push_back(output[s] == NONE ? NO_OUTPUT : output_rank(output[s]));
+			}
+
+			d_keyword_begin.push_back(0);
+			for (const auto& keyword : keywords) {
+				d_keyword_chars += keyword;
+				d_keyword_begin.push_back(d_keyword_chars.size());
+			}
+		}
+	};
+
 	typedef basic_trie<char>     trie;
 	typedef basic_trie<wchar_t>  wtrie;
+	typedef basic_dfa<char>      dfa;
+	typedef basic_double_array<char> double_array;
 
 
 } // namespace aho_corasick
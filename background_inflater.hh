@@ -0,0 +1,408 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <atomic>
+#include <fstream>
+#include <cstring>
+#include "zstr/zstr.hpp"
+
+// A BGZF file (the output of bgzip) is a series of gzip members of at most 64 KiB
+// each, whose headers store the compressed size of the member in an extra field.
+// The members can be found without inflating them, and are inflated in parallel
+// here. Every thread that inflates blocks owns one BGZF_Block_Decoder.
+class BGZF_Block_Decoder{
+
+private:
+
+    BGZF_Block_Decoder(const BGZF_Block_Decoder& temp_obj) = delete; // No copying
+    BGZF_Block_Decoder& operator=(const BGZF_Block_Decoder& temp_obj) = delete;  // No copying
+
+    z_stream zs;
+
+    static uint32_t read_le32(const unsigned char* p){
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+public:
+
+    static constexpr int64_t header_size = 18; // Header of a member with only the BGZF extra field
+    static constexpr int64_t trailer_size = 8; // CRC32 and the uncompressed size
+
+    // Returns the total size of the BGZF block that starts with the n bytes at p, 0
+    // if n is too small to tell, or -1 if the bytes are not the header of a BGZF block.
+    static int64_t block_size(const char* data, int64_t n){
+        const unsigned char* p = (const unsigned char*)data;
+        if(n < 12) return 0;
+        if(p[0] != 0x1F || p[1] != 0x8B || p[2] != 8 || !(p[3] & 4)) return -1; // gzip, deflate, FEXTRA
+        int64_t xlen = p[10] | (p[11] << 8);
+        if(n < 12 + xlen) return 0;
+        for(int64_t i = 12; i + 4 <= 12 + xlen; ){ // Look for the BC subfield
+            int64_t slen = p[i+2] | (p[i+3] << 8);
+            if(p[i] == 'B' && p[i+1] == 'C' && slen == 2 && i + 6 <= 12 + xlen){
+                int64_t size = (p[i+4] | (p[i+5] << 8)) + 1;
+                return size >= 12 + xlen + trailer_size ? size : -1;
+            }
+            i += 4 + slen;
+        }
+        return -1;
+    }
+
+    // Size of the inflated content of a complete block
+    static int64_t inflated_size(const char* block, int64_t size){
+        return read_le32((const unsigned char*)block + size - 4);
+    }
+
+    BGZF_Block_Decoder(){
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        zs.next_in = Z_NULL;
+        zs.avail_in = 0;
+        if(inflateInit2(&zs, -15) != Z_OK) throw std::runtime_error("Error: could not initialize zlib");
+    }
+
+    ~BGZF_Block_Decoder(){
+        inflateEnd(&zs);
+    }
+
+    // Inflates the complete block of the given size to dest, which has room for
+    // inflated_size(block, size) bytes, and checks the CRC32.
+    void decode(const char* block, int64_t size, char* dest){
+        const unsigned char* p = (const unsigned char*)block;
+        int64_t xlen = p[10] | (p[11] << 8);
+        int64_t out_size = inflated_size(block, size);
+        inflateReset(&zs);
+        zs.next_in = (Bytef*)(p + 12 + xlen);
+        zs.avail_in = size - 12 - xlen - trailer_size;
+        zs.next_out = (Bytef*)dest;
+        zs.avail_out = out_size;
+        int ret = inflate(&zs, Z_FINISH);
+        if(ret != Z_STREAM_END || (int64_t)zs.total_out != out_size
+           || crc32(crc32(0, Z_NULL, 0), (const Bytef*)dest, out_size) != read_le32(p + size - 8))
+            throw std::runtime_error("Error: corrupt BGZF block");
+    }
+
+};
+
+// A pool of threads that inflate one batch of BGZF blocks at a time. The thread
+// that calls inflate_batch inflates blocks too, so a pool of n threads has n - 1
+// workers. Every block is inflated to its own offset of the output, so the output
+// is in the order of the blocks no matter which thread finishes first.
+class BGZF_Thread_Pool{
+
+public:
+
+    struct Block{
+        int64_t offset; // In the compressed bytes
+        int64_t size;
+        int64_t out_offset; // In the inflated output
+    };
+
+private:
+
+    BGZF_Thread_Pool(const BGZF_Thread_Pool& temp_obj) = delete; // No copying
+    BGZF_Thread_Pool& operator=(const BGZF_Thread_Pool& temp_obj) = delete;  // No copying
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_ready; // Signaled when a batch starts or the pool stops
+    std::condition_variable work_done; // Signaled when a worker has no more blocks to take
+    int64_t batch_number = 0;
+    int64_t n_idle_workers = 0;
+    bool stop = false;
+    std::exception_ptr error;
+
+    // The current batch
+    const std::vector<Block>* blocks = nullptr;
+    const char* compressed = nullptr;
+    char* out = nullptr;
+    std::atomic<int64_t> next_block{0};
+
+    void inflate_blocks(BGZF_Block_Decoder& decoder){
+        while(true){
+            int64_t i = next_block++;
+            if(i >= (int64_t)blocks->size()) return;
+            const Block& b = (*blocks)[i];
+            try{
+                decoder.decode(compressed + b.offset, b.size, out + b.out_offset);
+            } catch(...){
+                std::lock_guard<std::mutex> lock(mutex);
+                if(!error) error = std::current_exception();
+            }
+        }
+    }
+
+    void work(){
+        BGZF_Block_Decoder decoder;
+        int64_t batches_done = 0;
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_ready.wait(lock, [&]{return stop || batch_number != batches_done;});
+                if(stop) return;
+                batches_done = batch_number;
+            }
+            inflate_blocks(decoder);
+            std::lock_guard<std::mutex> lock(mutex);
+            n_idle_workers++;
+            work_done.notify_one();
+        }
+    }
+
+    BGZF_Block_Decoder decoder; // For the calling thread
+
+public:
+
+    BGZF_Thread_Pool(int64_t n_threads){
+        for(int64_t i = 1; i < n_threads; i++) workers.emplace_back(&BGZF_Thread_Pool::work, this);
+    }
+
+    ~BGZF_Thread_Pool(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+            work_ready.notify_all();
+        }
+        for(std::thread& t : workers) t.join();
+    }
+
+    // Inflates every block in the batch from the compressed bytes to its offset of
+    // out, and returns when all of them are done.
+    void inflate_batch(const std::vector<Block>& batch, const char* compressed_bytes, char* output){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            blocks = &batch;
+            compressed = compressed_bytes;
+            out = output;
+            next_block = 0;
+            n_idle_workers = 0;
+            batch_number++;
+            work_ready.notify_all();
+        }
+        inflate_blocks(decoder);
+        std::unique_lock<std::mutex> lock(mutex);
+        work_done.wait(lock, [this]{return n_idle_workers == (int64_t)workers.size();});
+        if(error) std::rethrow_exception(error);
+    }
+
+};
+
+// Decompresses a gzip file on a background thread so that inflating and parsing
+// run at the same time. The thread inflates the file into chunks and puts them in
+// a small queue, and read takes the bytes from the queue in order. Files with many
+// concatenated gzip members are decompressed member after member, and a file that
+// is not compressed after all is passed through as it is. If the file starts with
+// a BGZF block, its blocks are inflated in parallel by a BGZF_Thread_Pool of
+// n_threads threads, and every batch of blocks becomes one chunk.
+//
+// The file is opened once by the constructor and only read forward, so it may
+// also be a pipe. Errors on the background thread, like a corrupt file or one
+// that ends in the middle of a gzip member, are thrown again from read.
+class Background_Inflater{
+
+private:
+
+    Background_Inflater(const Background_Inflater& temp_obj) = delete; // No copying
+    Background_Inflater& operator=(const Background_Inflater& temp_obj) = delete;  // No copying
+
+    static constexpr int64_t chunk_size = 1 << 20;
+    static constexpr int64_t max_queued_chunks = 4;
+
+    std::mutex mutex;
+    std::condition_variable chunk_ready; // Signaled when a chunk is queued or the thread is done
+    std::condition_variable space_ready; // Signaled when a chunk is taken or the reader quits
+    std::deque<std::vector<char>> queue;
+    bool done = false; // The thread will queue no more chunks
+    bool quit = false; // The reader is being destroyed
+    std::exception_ptr error;
+
+    std::vector<char> chunk; // The chunk being read by read
+    int64_t chunk_pos = 0;
+
+    std::string filename;
+    std::ifstream file;
+    int64_t n_threads; // For BGZF files
+
+    // Compressed bytes read from the file. input[input_pos..input_len) are not used yet.
+    std::vector<char> input;
+    int64_t input_pos = 0;
+    int64_t input_len = 0;
+
+    std::thread thread;
+
+    static constexpr int64_t blocks_per_batch = 256; // At most 16 MiB of output per chunk
+
+    // Waits for room in the queue and appends the chunk. Returns false if the reader quit.
+    bool push_chunk(std::vector<char>&& next){
+        std::unique_lock<std::mutex> lock(mutex);
+        space_ready.wait(lock, [this]{return quit || (int64_t)queue.size() < max_queued_chunks;});
+        if(quit) return false;
+        queue.push_back(std::move(next));
+        chunk_ready.notify_one();
+        return true;
+    }
+
+    // Moves the unused input to the start of the buffer and reads more from the
+    // file after it. Returns false if the file has no more bytes.
+    bool read_input(){
+        memmove(input.data(), input.data() + input_pos, input_len - input_pos);
+        input_len -= input_pos;
+        input_pos = 0;
+        file.read(input.data() + input_len, input.size() - input_len);
+        input_len += file.gcount();
+        return file.gcount() > 0;
+    }
+
+    // Inflates the gzip members from the unused input to the end of the file. If
+    // the input does not start with a gzip header, it is passed through as it is.
+    void inflate_gzip(){
+        if(input_len - input_pos < 2) read_input();
+        const unsigned char* magic = (const unsigned char*)input.data() + input_pos;
+        if(input_len - input_pos < 2 || magic[0] != 0x1F || magic[1] != 0x8B){
+            do{
+                std::vector<char> next(input.begin() + input_pos, input.begin() + input_len);
+                input_pos = input_len;
+                if(!next.empty() && !push_chunk(std::move(next))) return;
+            } while(read_input());
+            return;
+        }
+
+        zstr::detail::z_stream_wrapper zs(true);
+        std::vector<char> next(chunk_size);
+        int64_t next_len = 0;
+        bool in_member = true; // False between the end of a member and the start of the next one
+        while(input_pos < input_len || read_input()){
+            if(!in_member){
+                inflateReset(&zs);
+                in_member = true;
+            }
+            zs.next_in = (Bytef*)(input.data() + input_pos);
+            zs.avail_in = input_len - input_pos;
+            zs.next_out = (Bytef*)(next.data() + next_len);
+            zs.avail_out = chunk_size - next_len;
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            if(ret != Z_OK && ret != Z_STREAM_END) throw std::runtime_error("Error: corrupt gzip file " + filename);
+            input_pos = input_len - zs.avail_in;
+            next_len = chunk_size - zs.avail_out;
+            if(ret == Z_STREAM_END) in_member = false;
+            if(next_len == chunk_size){
+                if(!push_chunk(std::move(next))) return;
+                next = std::vector<char>(chunk_size);
+                next_len = 0;
+            }
+        }
+        if(in_member) throw std::runtime_error("Error: unexpected end of gzip file " + filename);
+        next.resize(next_len);
+        if(!next.empty()) push_chunk(std::move(next));
+    }
+
+    // Inflates batches of BGZF blocks from the unused input in parallel until the
+    // end of the file or until a gzip member that is not a BGZF block, from which
+    // on the rest of the file is inflated with inflate_gzip. The input buffer must
+    // have room for a full batch.
+    void inflate_bgzf(){
+        BGZF_Thread_Pool pool(n_threads);
+        std::vector<BGZF_Thread_Pool::Block> batch;
+        bool at_end = false;
+        while(true){
+            // Split the unused input into blocks, reading more until the batch is
+            // full. The offsets are from input_pos, which read_input keeps valid.
+            batch.clear();
+            int64_t pos = 0;
+            int64_t out_size = 0;
+            bool at_gzip_member = false;
+            while((int64_t)batch.size() < blocks_per_batch){
+                const char* block = input.data() + input_pos + pos;
+                int64_t n = input_len - input_pos - pos;
+                int64_t size = BGZF_Block_Decoder::block_size(block, n);
+                if(size > n) size = 0; // Block is not complete
+                if(size == 0 && !at_end){ // There is room for more, since no block is over 64 KiB
+                    at_end = !read_input();
+                    continue;
+                }
+                if(size == 0 && n == 0) break; // End of the file
+                if(size == -1){
+                    at_gzip_member = true;
+                    break;
+                }
+                if(size <= 0) throw std::runtime_error("Error: truncated or corrupt BGZF file " + filename);
+                int64_t block_out_size = BGZF_Block_Decoder::inflated_size(block, size);
+                if(block_out_size > (1 << 16)) throw std::runtime_error("Error: corrupt BGZF file " + filename);
+                batch.push_back({pos, size, out_size});
+                out_size += block_out_size;
+                pos += size;
+            }
+
+            std::vector<char> next(out_size);
+            if(!batch.empty()) pool.inflate_batch(batch, input.data() + input_pos, next.data());
+            input_pos += pos;
+            if(!next.empty() && !push_chunk(std::move(next))) return;
+            if(at_gzip_member){
+                inflate_gzip();
+                return;
+            }
+            if(batch.empty()) return;
+        }
+    }
+
+    void run(){
+        try{
+            read_input();
+            if(BGZF_Block_Decoder::block_size(input.data(), input_len) > 0){
+                input.resize(blocks_per_batch << 16); // Blocks are at most 64 KiB
+                inflate_bgzf();
+            } else inflate_gzip();
+        } catch(...){
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        chunk_ready.notify_one();
+    }
+
+public:
+
+    Background_Inflater(std::string filename, int64_t n_threads = 1) : filename(filename), file(filename, std::ios::binary), n_threads(std::max(n_threads, (int64_t)1)), input(chunk_size) {
+        if(!file.good()) throw std::runtime_error("Error opening file " + filename);
+        thread = std::thread(&Background_Inflater::run, this);
+    }
+
+    ~Background_Inflater(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+            space_ready.notify_one();
+        }
+        thread.join();
+    }
+
+    // Copies up to n decompressed bytes to dest, waiting for the thread if nothing
+    // is ready yet. Returns the number of bytes copied, which is 0 only at the end
+    // of the file.
+    int64_t read(char* dest, int64_t n){
+        if(chunk_pos == (int64_t)chunk.size()){
+            std::unique_lock<std::mutex> lock(mutex);
+            chunk_ready.wait(lock, [this]{return done || !queue.empty();});
+            if(queue.empty()){
+                if(error) std::rethrow_exception(error);
+                return 0;
+            }
+            chunk = std::move(queue.front());
+            queue.pop_front();
+            chunk_pos = 0;
+            space_ready.notify_one();
+        }
+        int64_t n_copied = std::min(n, (int64_t)chunk.size() - chunk_pos);
+        memcpy(dest, chunk.data() + chunk_pos, n_copied);
+        chunk_pos += n_copied;
+        return n_copied;
+    }
+
+};
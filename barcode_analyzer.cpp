@@ -1,20 +1,32 @@
 #include <iostream>
 #include <algorithm>
+#include <unordered_map>
+#include <string_view>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "SeqIO.hh"
 #include "cxxopts.hpp"
 #include "aho_corasick.hh"
+#include "kmer_matcher.hh"
+#include "prefilter.hh"
+#include "string_matching.hh"
 
 // Table mapping ascii values of characters to their reverse complements,
-// lower-case to lower case, upper-case to upper-case. Non-ACGT characters
+// lower-case to lower case, upper-case to upper-case. The IUPAC codes R, Y, K,
+// M, B, V, D and H are mapped to their complement codes, and other characters
 // are mapped to themselves.
 static constexpr unsigned char rc_table[256] =
 {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19,
 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37,
 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 52, 53, 54, 55,
-56, 57, 58, 59, 60, 61, 62, 63, 64, 84, 66, 71, 68, 69, 70, 67, 72, 73,
-74, 75, 76, 77, 78, 79, 80, 81, 82, 83, 65, 85, 86, 87, 88, 89, 90, 91,
-92, 93, 94, 95, 96, 116, 98, 103, 100, 101, 102, 99, 104, 105, 106, 107,
-108, 109, 110, 111, 112, 113, 114, 115, 97, 117, 118, 119, 120, 121, 122,
+56, 57, 58, 59, 60, 61, 62, 63, 64, 84, 86, 71, 72, 69, 70, 67, 68, 73,
+74, 77, 76, 75, 78, 79, 80, 81, 89, 83, 65, 85, 66, 87, 88, 82, 90, 91,
+92, 93, 94, 95, 96, 116, 118, 103, 104, 101, 102, 99, 100, 105, 106, 109,
+108, 107, 110, 111, 112, 113, 121, 115, 97, 117, 98, 119, 120, 114, 122,
 123, 124, 125, 126, 127, 128, 129, 130, 131, 132, 133, 134, 135, 136, 137,
 138, 139, 140, 141, 142, 143, 144, 145, 146, 147, 148, 149, 150, 151, 152,
 153, 154, 155, 156, 157, 158, 159, 160, 161, 162, 163, 164, 165, 166, 167,
@@ -46,11 +58,22 @@ vector<string> read_lines(string filename){
     return lines;
 }
 
-// Returns the Aho_Corasick trie and the number of barcodes. The reverse complement
-// of each barcode is added to the trie, but the number of barcodes returned does
-// not include the reverse complements.
-pair<std::shared_ptr<aho_corasick::trie>, int64_t> get_aho_corasick_trie(const string& barcode_file){
-    vector<string> barcodes = read_lines(barcode_file);
+// Peak resident set size of the process in megabytes
+double get_peak_rss_MB(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0; // ru_maxrss is in kilobytes on Linux
+}
+
+// Reads the barcodes of the files one after the other and appends the reverse
+// complement of each barcode after all the barcodes, so that pattern i and pattern
+// i + n_barcodes are the two strands of the same barcode.
+vector<string> read_barcodes_with_reverse_complements(const vector<string>& barcode_files){
+    vector<string> barcodes;
+    for(const string& file : barcode_files){
+        vector<string> lines = read_lines(file);
+        barcodes.insert(barcodes.end(), lines.begin(), lines.end());
+    }
     int64_t n_barcodes = barcodes.size();
 
     // Add reverse complements
@@ -59,49 +82,787 @@ pair<std::shared_ptr<aho_corasick::trie>, int64_t> get_aho_corasick_trie(const s
         rc_c_string(S.data(), S.size());
         barcodes.push_back(S);
     }
+    return barcodes;
+}
+
+// The patterns that the matchers search for, and the barcode that each pattern
+// belongs to. The first patterns are always the barcodes followed by their reverse
+// complements, so that pattern i < 2 * n_barcodes belongs to barcode i % n_barcodes.
+// With mismatches, they are followed by the other strings within that Hamming
+// distance of a barcode or a reverse complement. For a barcode index, patterns is
+// left empty unless the wildcards need it, since the automaton has the strings.
+struct Barcode_Patterns{
+    static constexpr int64_t ambiguous = -1; // Barcode of a pattern that is equally close to two barcodes
+
+    vector<string> patterns;
+    vector<int64_t> barcode_of_pattern;
+    vector<bool> is_reverse_strand; // True if the pattern is, or is closest to, the reverse complement of its barcode
+    int64_t n_barcodes = 0;
+    int64_t mismatches = 0;
+    int64_t n_ambiguous = 0; // Number of ambiguous patterns
+};
+
+// Calls f(S, distance) for every string S that differs from P at 1 to max_distance
+// positions, replacing characters by A, C, G or T. P must be upper case. N is not
+// used as a replacement, so an N in a read never counts as a mismatch: adding it
+// would grow the pattern set by a third at one mismatch and by three quarters at
+// two, and keep the hash engine from taking it. --min-base-quality lets N match
+// instead.
+template<typename F>
+void for_each_hamming_neighbor(string& P, int64_t from, int64_t distance, int64_t max_distance, F& f){
+    if(distance == max_distance) return;
+    for(int64_t i = from; i < (int64_t)P.size(); i++){
+        char original = P[i];
+        for(char c : {'A', 'C', 'G', 'T'}){
+            if(c == original) continue;
+            P[i] = c;
+            f(P, distance + 1);
+            for_each_hamming_neighbor(P, i + 1, distance + 1, max_distance, f);
+        }
+        P[i] = original;
+    }
+}
+
+// The barcodes of the patterns of n_barcodes barcodes and their reverse complements
+// without mismatches. The pattern strings are not filled in.
+Barcode_Patterns get_exact_barcode_patterns(int64_t n_barcodes){
+    Barcode_Patterns bp;
+    bp.n_barcodes = n_barcodes;
+    for(int64_t i = 0; i < 2 * n_barcodes; i++){
+        bp.barcode_of_pattern.push_back(i % n_barcodes);
+        bp.is_reverse_strand.push_back(i >= n_barcodes);
+    }
+    return bp;
+}
+
+// Takes the barcodes and their reverse complements as given by
+// read_barcodes_with_reverse_complements and adds their Hamming neighbors up to the
+// given number of mismatches. A neighbor belongs to the barcode that it is closest
+// to, and if two barcodes are equally close, it is ambiguous. Neighbors that are
+// barcodes themselves are not added.
+Barcode_Patterns get_barcode_patterns(const vector<string>& barcodes, int64_t mismatches){
+    Barcode_Patterns bp = get_exact_barcode_patterns(barcodes.size() / 2);
+    bp.patterns = barcodes;
+    bp.mismatches = mismatches;
+    if(mismatches == 0) return bp;
+
+    // Upper-cased pattern -> index in bp.patterns. The distance of each pattern to its barcode is in distances.
+    std::unordered_map<string, int64_t> pattern_index;
+    vector<int64_t> distances(barcodes.size(), 0);
+    int64_t n_strings = 0; // Upper bound for the number of patterns
+    for(const string& P : barcodes){
+        int64_t L = P.size();
+        n_strings += 1 + 3 * L + (mismatches == 2 ? 9 * L * (L - 1) / 2 : 0);
+    }
+    pattern_index.reserve(n_strings);
+    bp.patterns.reserve(n_strings);
+    bp.barcode_of_pattern.reserve(n_strings);
+    bp.is_reverse_strand.reserve(n_strings);
+    distances.reserve(n_strings);
+    for(int64_t i = 0; i < (int64_t)barcodes.size(); i++){
+        string P = barcodes[i];
+        for(char& c : P) c = toupper(c);
+        pattern_index.insert({P, i});
+    }
+    for(int64_t i = 0; i < (int64_t)barcodes.size(); i++){
+        int64_t barcode = i % bp.n_barcodes;
+        bool is_reverse = (i >= bp.n_barcodes);
+        string P = barcodes[i];
+        for(char& c : P) c = toupper(c);
+        auto add_neighbor = [&](const string& S, int64_t distance){
+            auto it = pattern_index.find(S);
+            if(it == pattern_index.end()){
+                pattern_index.insert({S, (int64_t)bp.patterns.size()});
+                bp.patterns.push_back(S);
+                bp.barcode_of_pattern.push_back(barcode);
+                bp.is_reverse_strand.push_back(is_reverse);
+                distances.push_back(distance);
+            } else{
+                int64_t j = it->second;
+                if(distance < distances[j]){
+                    bp.barcode_of_pattern[j] = barcode;
+                    bp.is_reverse_strand[j] = is_reverse;
+                    distances[j] = distance;
+                } else if(distance == distances[j] && bp.barcode_of_pattern[j] != barcode){
+                    bp.barcode_of_pattern[j] = Barcode_Patterns::ambiguous;
+                }
+            }
+        };
+        for_each_hamming_neighbor(P, 0, 0, mismatches, add_neighbor);
+    }
+    for(int64_t b : bp.barcode_of_pattern) bp.n_ambiguous += (b == Barcode_Patterns::ambiguous);
+    return bp;
+}
+
+// Returns true if some pattern has an IUPAC degenerate code such as N or R
+bool has_degenerate_bases(const vector<string>& patterns){
+    for(const string& P : patterns) for(char c : P) if(iupac_degenerate_bases(c) != nullptr) return true;
+    return false;
+}
+
+void print_build_report(const string& what, int64_t n_barcodes, int64_t size_bytes, std::chrono::steady_clock::time_point start_time){
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    cerr << "Built the " << what << " of " << n_barcodes << " barcodes: "
+         << size_bytes / (1024.0 * 1024.0) << " MB, " << elapsed.count() << " s, peak RSS " << get_peak_rss_MB() << " MB" << endl;
+}
+
+// Returns the Aho_Corasick automaton of the barcode patterns. If verbose is true,
+// the build time and the peak memory are reported to stderr. The automaton type is
+// aho_corasick::dfa or aho_corasick::double_array.
+template<typename automaton_t = aho_corasick::dfa>
+std::shared_ptr<automaton_t> get_aho_corasick_trie(const Barcode_Patterns& bp, int64_t n_threads, bool verbose){
+    auto start_time = std::chrono::steady_clock::now();
         
-    // Build the Aho-Corasick trie
-    std::shared_ptr<aho_corasick::trie> trie = std::make_shared<aho_corasick::trie>();
-    for(const string& B : barcodes) trie->insert(B);
-    return {trie, n_barcodes};
+    // Build the Aho-Corasick automaton. It is case insensitive, so the reads do not
+    // need to be upper-cased.
+    auto trie = std::make_shared<automaton_t>(bp.patterns, true, n_threads);
+
+    if(verbose){
+        print_build_report("Aho-Corasick automaton (" + to_string(trie->num_states()) + " states)", bp.n_barcodes, trie->size(), start_time);
+    }
+    return trie;
 }
 
-void analyze(const string& seq_file, const string& barcode_file, ostream& output, bool verbose){
+// A barcode index file is an Index_Header followed by the packed Aho-Corasick
+// automaton, which is used in place from a read-only memory mapping. The header
+// also has the prefilter tables, so that loading an index builds nothing. Bump the
+// version whenever the layout of the header or the automaton changes.
+struct Index_Header{
+    char magic[8];
+    uint32_t version;
+    uint32_t unused;
+    int64_t n_barcodes;
+    uint64_t automaton_size;
+    Teddy_Prefilter::Stored prefilter;
+};
+static_assert(sizeof(Index_Header) % 8 == 0, "The automaton after the header must be 8-byte aligned");
+
+static constexpr char index_magic[8] = "BCINDEX";
+static constexpr uint32_t index_version = 2;
+
+// A barcode index loaded by load_barcode_index
+struct Barcode_Index{
+    std::shared_ptr<aho_corasick::dfa> automaton;
+    int64_t n_barcodes;
+    Teddy_Prefilter::Stored prefilter;
+};
 
-    std::shared_ptr<aho_corasick::trie> trie; int64_t n_barcodes;
-    std::tie(trie, n_barcodes) = get_aho_corasick_trie(barcode_file);
-    SeqIO::Reader<> in(seq_file);
+void write_barcode_index(const string& barcode_file, const string& index_file, int64_t n_threads){
+    Barcode_Patterns bp = get_barcode_patterns(read_barcodes_with_reverse_complements({barcode_file}), 0);
+    if(has_degenerate_bases(bp.patterns)) throw runtime_error("Error: barcodes with IUPAC degenerate codes can not be put in a barcode index");
+    std::shared_ptr<aho_corasick::dfa> trie = get_aho_corasick_trie(bp, n_threads, true);
+
+    Index_Header header = {};
+    std::copy(index_magic, index_magic + 8, header.magic);
+    header.version = index_version;
+    header.n_barcodes = bp.n_barcodes;
+    header.automaton_size = trie->size();
+    header.prefilter = Teddy_Prefilter(bp.patterns).get_stored();
+
+    throwing_ofstream out(index_file, ios::binary);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)trie->data(), trie->size());
+}
+
+// Maps the index file read-only, so concurrent jobs share one page-cached copy.
+Barcode_Index load_barcode_index(const string& index_file){
+    int fd = open(index_file.c_str(), O_RDONLY);
+    if(fd == -1) throw runtime_error("Error opening file " + index_file);
+    struct stat st;
+    if(fstat(fd, &st) == -1){
+        close(fd);
+        throw runtime_error("Error reading file " + index_file);
+    }
+    size_t size = st.st_size;
+    if(size < sizeof(Index_Header)){
+        close(fd);
+        throw runtime_error("Error: " + index_file + " is not a barcode index");
+    }
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) throw runtime_error("Error memory-mapping file " + index_file);
+    madvise(addr, size, MADV_WILLNEED);
+    std::shared_ptr<const void> mapping(addr, [size](const void* p){ munmap(const_cast<void*>(p), size); });
+
+    const Index_Header* header = (const Index_Header*)addr;
+    if(!std::equal(index_magic, index_magic + 8, header->magic))
+        throw runtime_error("Error: " + index_file + " is not a barcode index");
+    if(header->version != index_version)
+        throw runtime_error("Error: " + index_file + " has index version " + to_string(header->version) +
+                            " but version " + to_string(index_version) + " is required. Rebuild it with the index command.");
+    if(header->automaton_size != size - sizeof(Index_Header))
+        throw runtime_error("Error: " + index_file + " is truncated");
+
+    std::shared_ptr<const void> automaton(mapping, (const char*)addr + sizeof(Index_Header));
+    Barcode_Index index = {std::make_shared<aho_corasick::dfa>(automaton, header->automaton_size), header->n_barcodes, header->prefilter};
+    if(index.n_barcodes <= 0 || (int64_t)index.automaton->num_keywords() != 2 * index.n_barcodes)
+        throw runtime_error("Error: " + index_file + " is corrupt");
+    return index;
+}
+
+// Calls f(matcher, bp) with the matcher behind the prefilter, or with the matcher
+// alone if the prefilter can not be used.
+template<typename matcher_t, typename F>
+void with_prefilter(const matcher_t* matcher, const Teddy_Prefilter& prefilter, const Barcode_Patterns& bp, bool verbose, F f){
+    if(verbose){
+        if(prefilter.is_enabled())
+            cerr << "Prefilter: " << prefilter.get_fingerprint_length() << "-byte fingerprints, "
+                 << prefilter.get_candidate_rate() << " expected candidates per position" << endl;
+        else cerr << "Prefilter: not used" << endl;
+    }
+    if(prefilter.is_enabled()){
+        Prefiltered_Matcher<matcher_t> prefiltered(&prefilter, matcher);
+        f(&prefiltered, bp);
+    } else f(matcher, bp);
+}
+
+// Same with a Teddy_Prefilter of the patterns
+template<typename matcher_t, typename F>
+void with_prefilter(const matcher_t* matcher, const Barcode_Patterns& bp, bool verbose, F f){
+    with_prefilter(matcher, Teddy_Prefilter(bp.patterns), bp, verbose, f);
+}
+
+// Above this many pattern characters, the automatic engine choice stores the
+// Aho-Corasick automaton as a double-array trie, which takes less memory.
+const int64_t double_array_min_total_length = int64_t(1) << 25;
+
+// Up to this many patterns (two barcodes and their reverse complements), comparing
+// them directly with the bitparallel engine is faster than the prefiltered
+// automaton. With more patterns, it is slower.
+const int64_t bitparallel_auto_max_patterns = 4;
+
+// From this many pattern characters on, the automaton no longer fits in the cache
+// and the hash engine is faster. Below it, the prefiltered automaton is faster.
+const int64_t hash_auto_min_total_length = int64_t(1) << 15;
+
+// Returns the engine that --engine auto uses for the barcode patterns: bitparallel
+// for at most bitparallel_auto_max_patterns patterns, hash if the patterns have at
+// least hash_auto_min_total_length characters in total and all of them have the
+// same length at most 32 and only contain ACGT, and aho-corasick otherwise.
+string choose_engine(const vector<string>& patterns){
+    if(Bit_Parallel_Matcher::supports(patterns) && (int64_t)patterns.size() <= bitparallel_auto_max_patterns) return "bitparallel";
+    int64_t total_length = 0;
+    for(const string& S : patterns) total_length += S.size();
+    if(total_length >= hash_auto_min_total_length && Kmer_Hash_Matcher::supports(patterns)) return "hash";
+    return "aho-corasick";
+}
+
+// Builds the matcher of the given engine from the barcode patterns and calls
+// f(matcher, bp) with it. Every matcher has the same
+// interface: scan(text, len, visit) calls visit(pattern_index, end_pos) for every
+// barcode occurrence, and contains_any(text, len) tells if there is one. All
+// engines report the same matches in the same order. Other than the bitparallel
+// engine, the matchers get a Teddy_Prefilter in front of them if the barcode set is
+// small enough for it.
+template<typename F>
+void with_engine(const string& engine, bool double_array, const Barcode_Patterns& bp, int64_t n_threads, bool verbose, F f){
+    auto start_time = std::chrono::steady_clock::now();
+    const vector<string>& patterns = bp.patterns;
+    if(engine == "bitparallel"){
+        if(!Bit_Parallel_Matcher::supports(patterns)) throw runtime_error("Error: the bitparallel engine takes at most 8 barcodes");
+        // Compares every pattern directly, so a prefilter would not help
+        Bit_Parallel_Matcher matcher(patterns);
+        if(verbose) print_build_report("bit-parallel matcher", bp.n_barcodes, matcher.size(), start_time);
+        f(&matcher, bp);
+    } else if(engine == "hash"){
+        if(!Kmer_Hash_Matcher::supports(patterns)) throw runtime_error("Error: the hash engine needs barcodes of the same length of at most 32 that only contain ACGT");
+        Kmer_Hash_Matcher matcher(patterns);
+        if(verbose) print_build_report(to_string(matcher.get_k()) + "-mer hash table", bp.n_barcodes, matcher.size(), start_time);
+        with_prefilter(&matcher, bp, verbose, f);
+    } else if(engine == "kmp"){
+        Kmp_Matcher matcher(patterns);
+        if(verbose) print_build_report("KMP matcher", bp.n_barcodes, matcher.size(), start_time);
+        with_prefilter(&matcher, bp, verbose, f);
+    } else if(double_array){
+        std::shared_ptr<aho_corasick::double_array> trie = get_aho_corasick_trie<aho_corasick::double_array>(bp, n_threads, verbose);
+        with_prefilter(trie.get(), bp, verbose, f);
+    } else{
+        std::shared_ptr<aho_corasick::dfa> trie = get_aho_corasick_trie(bp, n_threads, verbose);
+        with_prefilter(trie.get(), bp, verbose, f);
+    }
+}
+
+// Runs every engine that can take the barcodes over the first n_reads reads of the
+// sequence file, checks that they find the same matches, and returns the engine and
+// the double-array setting of the fastest one. The time per base of each engine is
+// logged to stderr. KMP is only tried for at most 8 barcodes because it scans the
+// reads once per pattern. The sequence file is read again for the real run, so it
+// must be a regular file and not a pipe.
+pair<string, bool> autotune_engine(const string& seq_file, int64_t n_reads, const Barcode_Patterns& bp, int64_t n_threads){
+    struct stat st;
+    if(stat(seq_file.c_str(), &st) == 0 && !S_ISREG(st.st_mode))
+        throw runtime_error("Error: --autotune reads the input twice, so it can not be used when the input is not a regular file: " + seq_file);
+
+    vector<string> sample;
+    int64_t n_bases = 0;
+    SeqIO::Reader<> in(seq_file, SeqIO::figure_out_file_format(seq_file).format, n_threads);
+    in.set_upper_case(false);
+    while((int64_t)sample.size() < n_reads){
+        int64_t len = in.get_next_read_to_buffer();
+        if(len == 0) break;
+        sample.push_back(string(in.read_buf, len));
+        n_bases += len;
+    }
+
+    vector<pair<string, bool>> candidates = {{"aho-corasick", false}, {"aho-corasick", true}};
+    if(Bit_Parallel_Matcher::supports(bp.patterns)) candidates.push_back({"bitparallel", false});
+    if(Kmer_Hash_Matcher::supports(bp.patterns)) candidates.push_back({"hash", false});
+    if(Bit_Parallel_Matcher::supports(bp.patterns)) candidates.push_back({"kmp", false});
+
+    pair<string, bool> best;
+    double best_ns_per_base = 0;
+    uint64_t reference_checksum = 0;
+    for(const pair<string, bool>& candidate : candidates){
+        string name = candidate.first + (candidate.second ? " (double-array)" : "");
+        with_engine(candidate.first, candidate.second, bp, n_threads, false, [&](const auto* matcher, const Barcode_Patterns&){
+            // The checksum covers every match and the order of the matches
+            uint64_t checksum = 0;
+            auto start_time = std::chrono::steady_clock::now();
+            for(int64_t i = 0; i < (int64_t)sample.size(); i++){
+                matcher->scan(sample[i].data(), sample[i].size(), [&](auto pattern_idx, auto end_pos){
+                    checksum = (checksum ^ (i * 0x100000001B3ULL + pattern_idx * 0x9E3779B97F4A7C15ULL + end_pos)) * 0xFF51AFD7ED558CCDULL;
+                });
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+            double ns_per_base = elapsed.count() * 1e9 / max(n_bases, (int64_t)1);
+            cerr << "Autotune: " << name << ": " << ns_per_base << " ns/base" << endl;
+
+            if(&candidate == &candidates[0]) reference_checksum = checksum;
+            else if(checksum != reference_checksum)
+                throw runtime_error("Error: the " + name + " engine found different matches than the " + candidates[0].first + " engine");
+            if(&candidate == &candidates[0] || ns_per_base < best_ns_per_base){
+                best = candidate;
+                best_ns_per_base = ns_per_base;
+            }
+        });
+    }
+    cerr << "Autotune: using " << best.first << (best.second ? " (double-array)" : "") << " after " << sample.size() << " reads and " << n_bases << " bases" << endl;
+    return best;
+}
+
+// Bases that can match any barcode character: N, and in FASTQ reads, the bases
+// with a quality below min_quality. Only used if min_quality is positive. A match
+// may use at most max_wildcards of them, where a wildcard is used if it differs
+// from the barcode.
+struct Wildcards{
+    int64_t min_quality = 0;
+    int64_t max_wildcards = 0;
+
+    bool enabled() const {return min_quality > 0;}
+};
+
+Wildcards get_wildcards(const cxxopts::ParseResult& opts_parsed){
+    Wildcards wildcards;
+    wildcards.min_quality = opts_parsed["min-base-quality"].as<int64_t>();
+    wildcards.max_wildcards = opts_parsed["max-wildcards"].as<int64_t>();
+    if(wildcards.min_quality < 0) throw runtime_error("Error: --min-base-quality can not be negative");
+    if(wildcards.max_wildcards < 1 || wildcards.max_wildcards > 3) throw runtime_error("Error: --max-wildcards must be 1, 2 or 3");
+    if(wildcards.enabled() && (opts_parsed["edit-distance"].as<int64_t>() > 0))
+        throw runtime_error("Error: --min-base-quality can not be used with --edit-distance");
+    return wildcards;
+}
+
+// Builds or loads the barcode matcher selected by the options and calls
+// f(matcher, bp) with it, as with_engine does. A barcode index given with
+// -x is always an Aho-Corasick automaton.
+template<typename F>
+void with_barcode_matcher(const cxxopts::ParseResult& opts_parsed, bool verbose, F f){
+    string engine = opts_parsed["engine"].as<string>();
+    bool double_array = opts_parsed["double-array"].as<bool>();
+    int64_t n_threads = opts_parsed["t"].as<int64_t>();
+    int64_t autotune_reads = opts_parsed["autotune"].as<int64_t>() * 1000;
+    int64_t mismatches = opts_parsed["mismatches"].as<int64_t>();
+    int64_t edit_distance = opts_parsed["edit-distance"].as<int64_t>();
+    if(mismatches < 0 || mismatches > 2) throw runtime_error("Error: --mismatches must be 0, 1 or 2");
+    if(edit_distance < 0) throw runtime_error("Error: --edit-distance must be non-negative");
+    if(edit_distance > 0 && (mismatches > 0 || engine != "auto" || double_array || autotune_reads > 0))
+        throw runtime_error("Error: --edit-distance can not be used with --mismatches, --engine, --double-array or --autotune");
+    vector<string> engines = {"auto", "aho-corasick", "kmp", "bitparallel", "hash"};
+    if(std::find(engines.begin(), engines.end(), engine) == engines.end())
+        throw runtime_error("Error: unknown engine " + engine);
+    if(double_array && engine != "auto" && engine != "aho-corasick")
+        throw runtime_error("Error: --double-array can only be used with the aho-corasick engine");
+    if(autotune_reads > 0 && (engine != "auto" || double_array))
+        throw runtime_error("Error: --autotune chooses the engine, so it can not be used with --engine or --double-array");
+
+    if(opts_parsed.count("x")){
+        if(double_array) throw runtime_error("Error: --double-array can not be used with a barcode index (-x)");
+        if(engine != "auto" && engine != "aho-corasick") throw runtime_error("Error: a barcode index (-x) can only be used with the aho-corasick engine");
+        if(autotune_reads > 0) throw runtime_error("Error: --autotune can not be used with a barcode index (-x)");
+        if(mismatches > 0) throw runtime_error("Error: --mismatches can not be used with a barcode index (-x)");
+        if(edit_distance > 0) throw runtime_error("Error: --edit-distance can not be used with a barcode index (-x)");
+        if(opts_parsed.count("rear-barcodes")) throw runtime_error("Error: --rear-barcodes can not be used with a barcode index (-x)");
+        if(verbose) cerr << "Engine: aho-corasick" << endl;
+        Barcode_Index index = load_barcode_index(opts_parsed["x"].as<string>());
+        Barcode_Patterns bp = get_exact_barcode_patterns(index.n_barcodes);
+        if(get_wildcards(opts_parsed).enabled()){ // The wildcards search a trie of the patterns
+            for(size_t i = 0; i < index.automaton->num_keywords(); i++) bp.patterns.push_back(index.automaton->get_keyword(i));
+        }
+        with_prefilter(index.automaton.get(), Teddy_Prefilter(index.prefilter), bp, verbose, f);
+        return;
+    }
+    if(!opts_parsed.count("b")) throw runtime_error("Error: either a barcode file (-b) or a barcode index (-x) must be given");
+
+    // With rear barcodes, the front barcodes come first and then the rear barcodes
+    vector<string> barcode_files = {opts_parsed["b"].as<string>()};
+    if(opts_parsed.count("rear-barcodes")) barcode_files.push_back(opts_parsed["rear-barcodes"].as<string>());
+    vector<string> barcodes = read_barcodes_with_reverse_complements(barcode_files);
+    bool degenerate = has_degenerate_bases(barcodes);
+    if(degenerate && (mismatches > 0 || engine != "auto" || double_array || autotune_reads > 0))
+        throw runtime_error("Error: barcodes with IUPAC degenerate codes can not be used with --mismatches, --engine, --double-array or --autotune");
+    Barcode_Patterns bp = get_barcode_patterns(barcodes, mismatches);
+    if(verbose && mismatches > 0){
+        cerr << "Added " << bp.patterns.size() - 2 * bp.n_barcodes << " strings within Hamming distance " << mismatches
+             << " of the barcodes, of which " << bp.n_ambiguous << " are ambiguous" << endl;
+    }
+
+    if(edit_distance > 0 || degenerate){
+        // The exact engines and the prefilter do not know edit distances or degenerate codes
+        if(!Myers_Matcher::supports(bp.patterns, edit_distance))
+            throw runtime_error("Error: --edit-distance and degenerate barcodes need barcodes of length at most 64 that are longer than the edit distance");
+        if(verbose) cerr << "Engine: myers, edit distance " << edit_distance << (degenerate ? ", degenerate barcodes" : "") << endl;
+        auto start_time = std::chrono::steady_clock::now();
+        Myers_Matcher matcher(bp.patterns, edit_distance);
+        if(verbose) print_build_report("Myers bit vectors", bp.n_barcodes, matcher.size(), start_time);
+        f(&matcher, bp);
+        return;
+    }
+
+    string how_chosen;
+    if(autotune_reads > 0){
+        std::tie(engine, double_array) = autotune_engine(opts_parsed["i"].as<string>(), autotune_reads, bp, n_threads);
+        how_chosen = ", chosen by autotuning";
+    } else if(engine == "auto"){
+        engine = double_array ? "aho-corasick" : choose_engine(bp.patterns);
+        int64_t total_length = 0;
+        for(const string& S : bp.patterns) total_length += S.size();
+        if(engine == "aho-corasick" && total_length >= double_array_min_total_length) double_array = true;
+        how_chosen = ", chosen automatically";
+    }
+    if(verbose) cerr << "Engine: " << engine << (double_array ? " (double-array)" : "") << how_chosen << endl;
+
+    with_engine(engine, double_array, bp, n_threads, verbose, f);
+}
+
+// The parts of a read that are searched for barcodes: the first start and the
+// last end bases. If both are zero, the whole read is searched.
+struct Search_Windows{
+    static constexpr int read_start = 0;
+    static constexpr int read_end = 1;
+
+    int64_t start = 0;
+    int64_t end = 0;
+
+    bool enabled() const {return start > 0 || end > 0;}
+};
+
+Search_Windows get_search_windows(const cxxopts::ParseResult& opts_parsed){
+    Search_Windows windows;
+    windows.start = opts_parsed["search-window-start"].as<int64_t>();
+    windows.end = opts_parsed["search-window-end"].as<int64_t>();
+    if(windows.start < 0 || windows.end < 0) throw runtime_error("Error: the search windows can not be negative");
+    return windows;
+}
+
+// Calls visit(pattern_idx, end_pos, which_end) for the matches that lie inside the
+// search windows of seq, where which_end is Search_Windows::read_start or
+// Search_Windows::read_end. If the windows overlap in a short read, a match inside
+// both of them is only reported for the start. Without windows, the whole read is
+// scanned and which_end is always read_start.
+template<typename matcher_t, typename Visitor>
+void scan_search_windows(const matcher_t* matcher, const Search_Windows& windows, const char* seq, int64_t len, Visitor&& visit){
+    if(!windows.enabled()){
+        matcher->scan(seq, len, [&](unsigned pattern_idx, size_t end_pos){
+            visit(pattern_idx, end_pos, Search_Windows::read_start);
+        });
+        return;
+    }
+    int64_t start_len = min(windows.start, len);
+    matcher->scan(seq, start_len, [&](unsigned pattern_idx, size_t end_pos){
+        visit(pattern_idx, end_pos, Search_Windows::read_start);
+    });
+    int64_t end_begin = max(len - windows.end, (int64_t)0);
+    matcher->scan(seq + end_begin, len - end_begin, [&](unsigned pattern_idx, size_t end_pos){
+        if(end_begin + (int64_t)end_pos < start_len) return; // Already reported for the start window
+        visit(pattern_idx, end_begin + end_pos, Search_Windows::read_end);
+    });
+}
+
+// Returns true if some barcode occurs inside the search windows of seq
+template<typename matcher_t>
+bool search_windows_contain_any(const matcher_t* matcher, const Search_Windows& windows, const char* seq, int64_t len){
+    if(!windows.enabled()) return matcher->contains_any(seq, len);
+    int64_t end_begin = max(len - windows.end, (int64_t)0);
+    return matcher->contains_any(seq, min(windows.start, len)) || matcher->contains_any(seq + end_begin, len - end_begin);
+}
+
+// Adds the matches that use wildcards to an exact matcher. Before the matcher is
+// used on a read, set_read finds the wildcards of the read, and then scan and
+// contains_any take parts of that read. The matches without wildcards come from
+// the exact matcher. The matches with wildcards are found by walking down a trie
+// of the patterns from every start position that has a wildcard within one
+// pattern length. The walk follows the read, and only at a wildcard it also
+// branches into the other children, at most max_wildcards times per path, so its
+// cost depends on how many patterns agree with the read around the wildcards
+// and not on the number of ways to replace them.
+template<typename matcher_t>
+class Wildcard_Matcher{
+
+private:
+
+    // The children of a node are contiguous, and so are the patterns that end at
+    // it. If no pattern has an IUPAC code, child_of_base also gives the child for
+    // each of A, C, G and T, or 0 if there is none.
+    struct Trie_Node{
+        uint32_t first_child = 0;
+        uint32_t n_children = 0;
+        uint32_t first_pattern = 0;
+        uint32_t n_patterns = 0;
+        uint32_t child_of_base[4] = {0, 0, 0, 0};
+        char label = 0;
+    };
+
+    const matcher_t* matcher;
+    const Barcode_Patterns* bp;
+    Wildcards wildcards;
+    int64_t max_pattern_len = 0;
+    vector<Trie_Node> trie; // Root at index 0
+    vector<uint32_t> trie_patterns;
+    bool degenerate = false; // Whether some pattern has an IUPAC code
+
+    const char* read = nullptr;
+    vector<int64_t> positions; // Wildcard positions in the current read
+    vector<char> is_wildcard; // Indexed by read position
+    mutable vector<Pattern_Match> found; // Matches in the text given to scan
+
+    // Same rules as the matchers: case insensitive, and IUPAC codes in the
+    // patterns. The labels are lower case.
+    bool base_matches(char c, char label) const {
+        c = to_lower_ascii(c);
+        if(c == label) return true;
+        if(!degenerate) return false;
+        const char* bases = iupac_degenerate_bases(label);
+        return bases != nullptr && (c == 'a' || c == 'c' || c == 'g' || c == 't') && strchr(bases, c ^ 0x20) != nullptr;
+    }
+
+    // 0, 1, 2 or 3 for A, C, G or T in either case, and 4 for other characters
+    static int64_t base_index(char c){
+        switch(c){
+            case 'A': case 'a': return 0;
+            case 'C': case 'c': return 1;
+            case 'G': case 'g': return 2;
+            case 'T': case 't': return 3;
+            default: return 4;
+        }
+    }
+
+    void build_trie(){
+        vector<string> lower(bp->patterns.size());
+        vector<uint32_t> order(bp->patterns.size());
+        for(int64_t i = 0; i < (int64_t)lower.size(); i++){
+            lower[i] = bp->patterns[i];
+            for(char& c : lower[i]){
+                c = to_lower_ascii(c);
+                if(iupac_degenerate_bases(c) != nullptr) degenerate = true;
+            }
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b){return lower[a] < lower[b];});
+
+        // Breadth-first, so that the children of each node are added together.
+        // The patterns of node queue[i].node are order[lo..hi), with a common
+        // prefix of length depth.
+        struct Item{uint32_t node; int64_t lo, hi, depth;};
+        vector<Item> queue = {{0, 0, (int64_t)order.size(), 0}};
+        trie.assign(1, Trie_Node());
+        for(int64_t q = 0; q < (int64_t)queue.size(); q++){
+            Item item = queue[q];
+            int64_t i = item.lo;
+            trie[item.node].first_pattern = trie_patterns.size();
+            for(; i < item.hi && (int64_t)lower[order[i]].size() == item.depth; i++) trie_patterns.push_back(order[i]);
+            trie[item.node].n_patterns = trie_patterns.size() - trie[item.node].first_pattern;
+            trie[item.node].first_child = trie.size();
+            while(i < item.hi){
+                char label = lower[order[i]][item.depth];
+                int64_t group_end = i;
+                while(group_end < item.hi && lower[order[group_end]][item.depth] == label) group_end++;
+                Trie_Node child;
+                child.label = label;
+                queue.push_back({(uint32_t)trie.size(), i, group_end, item.depth + 1});
+                trie.push_back(child);
+                i = group_end;
+            }
+            trie[item.node].n_children = trie.size() - trie[item.node].first_child;
+        }
+        if(degenerate) return;
+        for(Trie_Node& node : trie){
+            for(uint32_t i = node.first_child; i < node.first_child + node.n_children; i++) node.child_of_base[base_index(trie[i].label)] = i;
+        }
+    }
+
+    // Calls visit(pattern_idx, end_pos) for the matches that continue from trie
+    // node n at read[pos], end before read[end] and use wildcards, where used
+    // wildcards were used to reach n. last_wildcard is the last wildcard that such
+    // a match can cover.
+    template<typename Visitor>
+    void walk(uint32_t n, int64_t pos, int64_t used, int64_t end, int64_t last_wildcard, Visitor& visit) const {
+        const Trie_Node& node = trie[n];
+        if(used > 0){
+            for(uint32_t i = 0; i < node.n_patterns; i++) visit(trie_patterns[node.first_pattern + i], pos - 1);
+        }
+        if(pos >= end || (used == 0 && pos > last_wildcard)) return;
+        char c = read[pos];
+        bool wildcard = is_wildcard[pos] && used < wildcards.max_wildcards;
+        if(!degenerate){
+            int64_t b = base_index(c);
+            if(!wildcard){
+                if(b < 4 && node.child_of_base[b] != 0) walk(node.child_of_base[b], pos + 1, used, end, last_wildcard, visit);
+                return;
+            }
+            for(int64_t x = 0; x < 4; x++){
+                if(node.child_of_base[x] != 0) walk(node.child_of_base[x], pos + 1, used + (x != b), end, last_wildcard, visit);
+            }
+            return;
+        }
+        for(uint32_t i = node.first_child; i < node.first_child + node.n_children; i++){
+            if(base_matches(c, trie[i].label)) walk(i, pos + 1, used, end, last_wildcard, visit);
+            else if(wildcard) walk(i, pos + 1, used + 1, end, last_wildcard, visit);
+        }
+    }
+
+    // Calls visit(pattern_idx, end_pos) for the matches in read[begin..end) that use wildcards
+    template<typename Visitor>
+    void scan_wildcard_matches(int64_t begin, int64_t end, Visitor& visit) const {
+        for(int64_t start = begin; start < end; start++){
+            auto next = std::lower_bound(positions.begin(), positions.end(), start);
+            if(next == positions.end() || *next >= end) break;
+            if(*next - start >= max_pattern_len){
+                start = *next - max_pattern_len; // Next start within one pattern length of it
+                continue;
+            }
+            int64_t limit = min(end, start + max_pattern_len);
+            int64_t last_wildcard = *(std::lower_bound(next, positions.end(), limit) - 1);
+            walk(0, start, 0, end, last_wildcard, visit);
+        }
+    }
+
+public:
+
+    Wildcard_Matcher(const matcher_t* matcher, const Barcode_Patterns* bp, const Wildcards& wildcards) : matcher(matcher), bp(bp), wildcards(wildcards) {
+        for(const string& P : bp->patterns) max_pattern_len = max(max_pattern_len, (int64_t)P.size());
+        if(wildcards.enabled()) build_trie();
+    }
+
+    // qual is nullptr for FASTA reads
+    void set_read(const char* seq, const char* qual, int64_t len){
+        read = seq;
+        positions.clear();
+        if(!wildcards.enabled()) return;
+        is_wildcard.assign(len, false);
+        for(int64_t i = 0; i < len; i++){
+            if(seq[i] == 'N' || seq[i] == 'n' || (qual != nullptr && qual[i] - 33 < wildcards.min_quality)){
+                positions.push_back(i);
+                is_wildcard[i] = true;
+            }
+        }
+    }
+
+    // text must be a part of the read given to set_read. With mismatches, several
+    // ways to use the wildcards, or a use of them and the read itself, can match
+    // the same barcode at the same end. Such a match is reported only once.
+    template<typename Visitor>
+    void scan(const char* text, int64_t len, Visitor&& visit) const {
+        if(positions.empty()){
+            matcher->scan(text, len, visit);
+            return;
+        }
+        int64_t offset = text - read;
+        found.clear();
+        matcher->scan(text, len, [&](auto pattern_idx, auto end_pos){
+            found.push_back({(int64_t)end_pos, (uint32_t)pattern_idx});
+        });
+        auto add_wildcard_match = [&](auto pattern_idx, int64_t end_pos){
+            found.push_back({end_pos - offset, (uint32_t)pattern_idx});
+        };
+        scan_wildcard_matches(offset, offset + len, add_wildcard_match);
+
+        auto same_barcode_and_end = [&](const Pattern_Match& a, const Pattern_Match& b){
+            return a.end == b.end && bp->barcode_of_pattern[a.pattern] == bp->barcode_of_pattern[b.pattern];
+        };
+        std::stable_sort(found.begin(), found.end(), [&](const Pattern_Match& a, const Pattern_Match& b){
+            if(a.end != b.end) return a.end < b.end;
+            return bp->barcode_of_pattern[a.pattern] < bp->barcode_of_pattern[b.pattern];
+        });
+        found.erase(std::unique(found.begin(), found.end(), same_barcode_and_end), found.end());
+        sort_in_automaton_order(found, bp->patterns);
+        for(const Pattern_Match& m : found) visit(m.pattern, m.end);
+    }
+
+    bool contains_any(const char* text, int64_t len) const {
+        if(matcher->contains_any(text, len)) return true;
+        bool found = false;
+        scan(text, len, [&](auto, auto){found = true;});
+        return found;
+    }
+
+};
+
+template<typename automaton_t>
+void analyze(const string& seq_file, const automaton_t* trie, const Barcode_Patterns& bp, const Search_Windows& windows, const Wildcards& wildcards, bool per_strand, ostream& output, bool verbose, int64_t n_threads){
+    int64_t n_barcodes = bp.n_barcodes;
+
+    SeqIO::Reader<> in(seq_file, SeqIO::figure_out_file_format(seq_file).format, n_threads);
+    in.set_upper_case(false);
+    Wildcard_Matcher<automaton_t> matcher(trie, &bp, wildcards);
 
     vector<int64_t> global_counts(n_barcodes); // Counts of barcodes in all sequences
     vector<int64_t> local_counts(n_barcodes); // Counts of barcodes in the current sequence
 
+    // The parts of the counts above that come from the end window of the reads
+    vector<int64_t> global_end_counts(n_barcodes);
+    vector<int64_t> local_end_counts(n_barcodes);
+
+    // The parts of the counts above that are matches of the reverse complement of the barcode
+    vector<int64_t> global_reverse_counts(n_barcodes);
+    vector<int64_t> local_reverse_counts(n_barcodes);
+
     // List of distinct barcodes found in the current sequence
     vector<int64_t> local_barcodes_found;
 
     int64_t n_seqs_with_multiple_barcodes = 0;
 
-    while(true){
-        int64_t len = in.get_next_read_to_buffer();
-        if(len == 0) break;
-        char* seq = in.read_buf;
-        
-        auto AC_result = trie->parse_text(seq);
-        for(auto x : AC_result){
-            // The modulo is to map the reverse complement barcodes to the same barcode as the original
-            int64_t barcode_idx = x.get_index() % n_barcodes;
+    // Sequences with a match that is equally close to two barcodes. Only possible with mismatches.
+    int64_t n_seqs_with_ambiguous_matches = 0;
+    bool local_ambiguous = false;
+
+    SeqIO::Record_View record;
+    while(in.get_next_record_view(record)){
+        // The read is matched where it is in the input buffer, without copying it
+        const char* seq = record.seq;
+        int64_t len = record.seq_len;
+        matcher.set_read(seq, record.qual, len);
+
+        scan_search_windows(&matcher, windows, seq, len, [&](unsigned pattern_idx, size_t, int which_end){
+            int64_t barcode_idx = bp.barcode_of_pattern[pattern_idx];
+            if(barcode_idx == Barcode_Patterns::ambiguous){
+                local_ambiguous = true;
+                return;
+            }
 
             //global_counts[barcode_idx]++;
             if(local_counts[barcode_idx] == 0){
                 local_barcodes_found.push_back(barcode_idx);
             }
             local_counts[barcode_idx]++;
-        }
+            if(which_end == Search_Windows::read_end) local_end_counts[barcode_idx]++;
+            if(bp.is_reverse_strand[pattern_idx]) local_reverse_counts[barcode_idx]++;
+        });
 
         if(local_barcodes_found.size() >= 2){
             // Multiple distinct barcodes in this sequence
             n_seqs_with_multiple_barcodes++;
             if(verbose){
-                output << "Mixed barcodes in sequence: " << in.header_buf << "\n";
+                output << "Mixed barcodes in sequence: " << std::string_view(record.header, record.header_len) << "\n";
                 output << "Found barcodes: ";
                 for(int64_t i = 0; i < (int64_t)local_barcodes_found.size(); i++)
                     output << (i == 0 ? "" : " ") << local_barcodes_found[i];
@@ -111,19 +872,124 @@ void analyze(const string& seq_file, const string& barcode_file, ostream& output
             // Add local counts to global counts
             for(int64_t x : local_barcodes_found){
                 global_counts[x] += local_counts[x];
+                global_end_counts[x] += local_end_counts[x];
+                global_reverse_counts[x] += local_reverse_counts[x];
             }
         }
 
+        if(local_ambiguous){
+            n_seqs_with_ambiguous_matches++;
+            if(verbose) output << "Ambiguous barcode match in sequence: " << std::string_view(record.header, record.header_len) << "\n";
+        }
+
         // Clear local counters
-        for(int64_t x : local_barcodes_found) local_counts[x] = 0;
+        for(int64_t x : local_barcodes_found) local_counts[x] = local_end_counts[x] = local_reverse_counts[x] = 0;
         local_barcodes_found.clear();
+        local_ambiguous = false;
     }
 
     for(int64_t i = 0; i < (int64_t)global_counts.size(); i++){
         // Print barcodes in 1-based indexing
-        output << "Barcode " << i+1 << ": " << global_counts[i] << endl;
+        output << "Barcode " << i+1 << ": " << global_counts[i];
+        vector<string> parts;
+        if(windows.enabled()){
+            parts.push_back("start: " + to_string(global_counts[i] - global_end_counts[i]));
+            parts.push_back("end: " + to_string(global_end_counts[i]));
+        }
+        if(per_strand){
+            parts.push_back("forward: " + to_string(global_counts[i] - global_reverse_counts[i]));
+            parts.push_back("reverse: " + to_string(global_reverse_counts[i]));
+        }
+        for(int64_t j = 0; j < (int64_t)parts.size(); j++) output << (j == 0 ? " (" : ", ") << parts[j];
+        output << (parts.empty() ? "" : ")") << endl;
+    }
+    output << "Mixed: " << n_seqs_with_multiple_barcodes << endl;
+    if(bp.mismatches > 0) output << "Ambiguous: " << n_seqs_with_ambiguous_matches << endl;
+}
+
+// Dual-barcode version of analyze. Barcodes 0..n_front-1 of bp are the front
+// barcodes and the rest are the rear barcodes. A read with exactly one distinct
+// front barcode and one distinct rear barcode counts for that pair, in either
+// orientation of the read. The pair counts are kept in a hash table, since most
+// pairs do not occur, and are written as a matrix with a row per front barcode
+// and a column per rear barcode.
+template<typename automaton_t>
+void analyze_barcode_pairs(const string& seq_file, const automaton_t* trie, const Barcode_Patterns& bp, int64_t n_front, const Search_Windows& windows, const Wildcards& wildcards, ostream& output, bool verbose, int64_t n_threads){
+    int64_t n_rear = bp.n_barcodes - n_front;
+
+    SeqIO::Reader<> in(seq_file, SeqIO::figure_out_file_format(seq_file).format, n_threads);
+    in.set_upper_case(false);
+    Wildcard_Matcher<automaton_t> matcher(trie, &bp, wildcards);
+
+    std::unordered_map<int64_t, int64_t> pair_counts; // front * n_rear + rear -> count
+    vector<int64_t> local_front, local_rear; // Distinct barcodes found in the current sequence
+
+    int64_t n_seqs_with_multiple_barcodes = 0;
+    int64_t n_seqs_without_front = 0;
+    int64_t n_seqs_without_rear = 0;
+    int64_t n_seqs_without_barcodes = 0;
+    int64_t n_seqs_with_ambiguous_matches = 0;
+    bool local_ambiguous = false;
+
+    SeqIO::Record_View record;
+    while(in.get_next_record_view(record)){
+        // The read is matched where it is in the input buffer, without copying it
+        const char* seq = record.seq;
+        int64_t len = record.seq_len;
+        matcher.set_read(seq, record.qual, len);
+
+        scan_search_windows(&matcher, windows, seq, len, [&](unsigned pattern_idx, size_t, int){
+            int64_t barcode_idx = bp.barcode_of_pattern[pattern_idx];
+            if(barcode_idx == Barcode_Patterns::ambiguous){
+                local_ambiguous = true;
+                return;
+            }
+            vector<int64_t>& found = barcode_idx < n_front ? local_front : local_rear;
+            if(std::find(found.begin(), found.end(), barcode_idx) == found.end()) found.push_back(barcode_idx);
+        });
+
+        if(local_front.size() >= 2 || local_rear.size() >= 2){
+            n_seqs_with_multiple_barcodes++;
+            if(verbose){
+                output << "Mixed barcodes in sequence: " << std::string_view(record.header, record.header_len) << "\n";
+                output << "Found front barcodes:";
+                for(int64_t x : local_front) output << " " << x;
+                output << "\nFound rear barcodes:";
+                for(int64_t x : local_rear) output << " " << x - n_front;
+                output << "\n";
+            }
+        } else if(local_front.empty() && local_rear.empty()) n_seqs_without_barcodes++;
+        else if(local_front.empty()) n_seqs_without_front++;
+        else if(local_rear.empty()) n_seqs_without_rear++;
+        else pair_counts[local_front[0] * n_rear + local_rear[0] - n_front]++;
+
+        if(local_ambiguous){
+            n_seqs_with_ambiguous_matches++;
+            if(verbose) output << "Ambiguous barcode match in sequence: " << std::string_view(record.header, record.header_len) << "\n";
+        }
+
+        local_front.clear();
+        local_rear.clear();
+        local_ambiguous = false;
+    }
+
+    // Front and rear barcodes in 1-based indexing
+    output << "Front\\Rear";
+    for(int64_t j = 0; j < n_rear; j++) output << "\t" << j+1;
+    output << "\n";
+    for(int64_t i = 0; i < n_front; i++){
+        output << i+1;
+        for(int64_t j = 0; j < n_rear; j++){
+            auto it = pair_counts.find(i * n_rear + j);
+            output << "\t" << (it == pair_counts.end() ? 0 : it->second);
+        }
+        output << "\n";
     }
     output << "Mixed: " << n_seqs_with_multiple_barcodes << endl;
+    output << "No front barcode: " << n_seqs_without_front << endl;
+    output << "No rear barcode: " << n_seqs_without_rear << endl;
+    output << "No barcodes: " << n_seqs_without_barcodes << endl;
+    if(bp.mismatches > 0) output << "Ambiguous: " << n_seqs_with_ambiguous_matches << endl;
 }
 
 int analyze_main(int argc, char** argv){
@@ -133,6 +999,19 @@ int analyze_main(int argc, char** argv){
         ("i", "The sequence file in fasta or fastq format.", cxxopts::value<string>())
         ("o", "Output file. If not given, prints to stdout.", cxxopts::value<string>())
         ("b", "A file containing the barcodes, one per line. Do not give reverse complements.", cxxopts::value<string>())
+        ("x", "A barcode index built with the index command. Can be given instead of -b.", cxxopts::value<string>())
+        ("rear-barcodes", "A file containing the rear barcodes of dual-barcoded reads, one per line. Then the barcodes of -b are the front barcodes, and the output is a matrix of the counts of the (front, rear) pairs, with a row per front barcode and a column per rear barcode. Not available with -x or --per-strand.", cxxopts::value<string>())
+        ("t,threads", "Number of threads used to build the barcode matcher and to decompress BGZF input.", cxxopts::value<int64_t>()->default_value("1"))
+        ("engine", "The barcode matcher: auto, aho-corasick, kmp, bitparallel or hash. The bitparallel engine takes at most 8 barcodes, and the hash engine needs barcodes of the same length of at most 32 that only contain ACGT. auto picks one of these from the barcodes.", cxxopts::value<string>()->default_value("auto"))
+        ("double-array", "Store the barcodes in a double-array trie. Takes less memory than the default automaton for very large barcode sets, but scans slower. Only for the aho-corasick engine, and not available with -x.", cxxopts::value<bool>()->default_value("false"))
+        ("autotune", "Time every engine that can take the barcodes on the first N thousand reads, check that they agree, and use the fastest one. Logs the time per base of each engine. Not available with -x, and the input must be a regular file.", cxxopts::value<int64_t>()->default_value("0")->implicit_value("10"), "N")
+        ("mismatches", "Also match strings within this Hamming distance (0, 1 or 2) of a barcode. Such a string counts for the closest barcode. If two barcodes are equally close, the match is ambiguous and does not count for either. A mismatch is always A, C, G or T, so an N in a read does not match (see --min-base-quality). Not available with -x.", cxxopts::value<int64_t>()->default_value("0"))
+        ("edit-distance", "Match the barcodes with up to this many substitutions, insertions and deletions, using Myers' bit-vector algorithm. Each occurrence is counted once, at its best end position. Needs barcodes of length at most 64 that are longer than the edit distance. Not available with -x, --mismatches, --engine or --autotune.", cxxopts::value<int64_t>()->default_value("0"))
+        ("search-window-start", "Only search the first N bases of each read, and the last bases if --search-window-end is given. The counts then tell how many matches came from each end of the reads. 0 means no window.", cxxopts::value<int64_t>()->default_value("0"), "N")
+        ("search-window-end", "Only search the last N bases of each read, and the first bases if --search-window-start is given. 0 means no window.", cxxopts::value<int64_t>()->default_value("0"), "N")
+        ("min-base-quality", "Let N and the bases of FASTQ reads with a Phred quality below Q match any barcode character. 0 means that only exact characters match. Not available with --edit-distance.", cxxopts::value<int64_t>()->default_value("0"), "Q")
+        ("max-wildcards", "The number of such bases that one match may use: 1, 2 or 3.", cxxopts::value<int64_t>()->default_value("1"))
+        ("per-strand", "Also write how many matches of each barcode were of the barcode itself (forward) and of its reverse complement (reverse).", cxxopts::value<bool>()->default_value("false"))
         ("v,verbose", "Verbose output.", cxxopts::value<bool>()->default_value("false"))
         ("h,help", "Print usage")
     ;
@@ -146,7 +1025,6 @@ int analyze_main(int argc, char** argv){
 
     bool to_stdout = false;
     string seq_file = opts_parsed["i"].as<string>();
-    string barcode_file = opts_parsed["b"].as<string>();
     string output_file;
     try{
         output_file = opts_parsed["o"].as<string>();
@@ -154,39 +1032,56 @@ int analyze_main(int argc, char** argv){
         to_stdout = true;
     }
     bool verbose = opts_parsed["v"].as<bool>();
+    Search_Windows windows = get_search_windows(opts_parsed);
+    bool per_strand = opts_parsed["per-strand"].as<bool>();
+    Wildcards wildcards = get_wildcards(opts_parsed);
+    int64_t n_threads = opts_parsed["t"].as<int64_t>();
 
-    if(to_stdout) analyze(seq_file, barcode_file, cout, verbose);
-    else{
-        ofstream out(output_file);
-        analyze(seq_file, barcode_file, out, verbose);
+    ofstream out;
+    if(!to_stdout) out.open(output_file);
+    ostream& output = to_stdout ? cout : out;
+
+    if(opts_parsed.count("rear-barcodes")){
+        if(per_strand) throw runtime_error("Error: --per-strand can not be used with --rear-barcodes");
+        if(!opts_parsed.count("b")) throw runtime_error("Error: --rear-barcodes needs the front barcodes (-b)");
+        int64_t n_front = read_lines(opts_parsed["b"].as<string>()).size();
+        with_barcode_matcher(opts_parsed, verbose, [&](const auto* matcher, const Barcode_Patterns& bp){
+            analyze_barcode_pairs(seq_file, matcher, bp, n_front, windows, wildcards, output, verbose, n_threads);
+        });
+        return 0;
     }
 
+    with_barcode_matcher(opts_parsed, verbose, [&](const auto* matcher, const Barcode_Patterns& bp){
+        analyze(seq_file, matcher, bp, windows, wildcards, per_strand, output, verbose, n_threads);
+    });
+
     return 0;
 
 }
 
 
-void filter_barcodes(const string& seq_file, const string& barcode_file, const string& out_file){
-    std::shared_ptr<aho_corasick::trie> trie; int64_t n_barcodes;
-    std::tie(trie, n_barcodes) = get_aho_corasick_trie(barcode_file);
-    SeqIO::Reader<> in(seq_file);
+template<typename automaton_t>
+void filter_barcodes(const string& seq_file, const automaton_t* trie, const Barcode_Patterns& bp, const Search_Windows& windows, const Wildcards& wildcards, const string& out_file, int64_t n_threads){
+    SeqIO::Reader<> in(seq_file, SeqIO::figure_out_file_format(seq_file).format, n_threads);
+    in.set_upper_case(false);
+    Wildcard_Matcher<automaton_t> matcher(trie, &bp, wildcards);
     SeqIO::Writer<> out(out_file);
 
     int64_t n_seqs_read = 0;
     int64_t n_seqs_filtered = 0;
-    while(true){
-        int64_t len = in.get_next_read_to_buffer();
-        if(len == 0) break;
-
+    string upper_seq; // The reads are written in upper case
+    SeqIO::Record_View record;
+    while(in.get_next_record_view(record)){
         n_seqs_read++;
-        const char* seq = in.read_buf;
-        const char* header = in.header_buf;
-        const char* qual = in.qual_buf;
+        const char* seq = record.seq;
+        int64_t len = record.seq_len;
+        matcher.set_read(seq, record.qual, len);
 
-        auto AC_result = trie->parse_text(seq);
-        if(AC_result.size() == 0){
+        if(!search_windows_contain_any(&matcher, windows, seq, len)){
             // No barcodes -> write to output
-            out.write_sequence(seq, len, qual, header, strlen(header));
+            upper_seq.assign(seq, len);
+            for(char& c : upper_seq) c = (c >= 'a' && c <= 'z') ? c - 32 : c;
+            out.write_sequence(upper_seq.data(), len, record.qual, record.header, record.header_len);
         } else n_seqs_filtered++;
     } 
 
@@ -201,6 +1096,18 @@ int filter_main(int argc, char** argv){
         ("i", "The sequence file in fasta or fastq format.", cxxopts::value<string>())
         ("o", "Output file.", cxxopts::value<string>())
         ("b", "A file containing the barcodes, one per line. Do not give reverse complements.", cxxopts::value<string>())
+        ("x", "A barcode index built with the index command. Can be given instead of -b.", cxxopts::value<string>())
+        ("t,threads", "Number of threads used to build the barcode matcher and to decompress BGZF input.", cxxopts::value<int64_t>()->default_value("1"))
+        ("engine", "The barcode matcher: auto, aho-corasick, kmp, bitparallel or hash. The bitparallel engine takes at most 8 barcodes, and the hash engine needs barcodes of the same length of at most 32 that only contain ACGT. auto picks one of these from the barcodes.", cxxopts::value<string>()->default_value("auto"))
+        ("double-array", "Store the barcodes in a double-array trie. Takes less memory than the default automaton for very large barcode sets, but scans slower. Only for the aho-corasick engine, and not available with -x.", cxxopts::value<bool>()->default_value("false"))
+        ("autotune", "Time every engine that can take the barcodes on the first N thousand reads, check that they agree, and use the fastest one. Logs the time per base of each engine. Not available with -x, and the input must be a regular file.", cxxopts::value<int64_t>()->default_value("0")->implicit_value("10"), "N")
+        ("mismatches", "Also remove sequences that have a string within this Hamming distance (0, 1 or 2) of a barcode. A mismatch is always A, C, G or T, so an N in a read does not match (see --min-base-quality). Not available with -x.", cxxopts::value<int64_t>()->default_value("0"))
+        ("edit-distance", "Also remove sequences that have a string within this edit distance of a barcode, using Myers' bit-vector algorithm. Needs barcodes of length at most 64 that are longer than the edit distance. Not available with -x, --mismatches, --engine or --autotune.", cxxopts::value<int64_t>()->default_value("0"))
+        ("search-window-start", "Only search the first N bases of each read, and the last bases if --search-window-end is given. 0 means no window.", cxxopts::value<int64_t>()->default_value("0"), "N")
+        ("search-window-end", "Only search the last N bases of each read, and the first bases if --search-window-start is given. 0 means no window.", cxxopts::value<int64_t>()->default_value("0"), "N")
+        ("min-base-quality", "Let N and the bases of FASTQ reads with a Phred quality below Q match any barcode character. 0 means that only exact characters match. Not available with --edit-distance.", cxxopts::value<int64_t>()->default_value("0"), "Q")
+        ("max-wildcards", "The number of such bases that one match may use: 1, 2 or 3.", cxxopts::value<int64_t>()->default_value("1"))
+        ("v,verbose", "Report the barcode matcher that is used and how long building it took.", cxxopts::value<bool>()->default_value("false"))
         ("h,help", "Print usage")
     ;
 
@@ -212,10 +1119,41 @@ int filter_main(int argc, char** argv){
     }
 
     string seq_file = opts_parsed["i"].as<string>();
+    string output_file = opts_parsed["o"].as<string>();
+    Search_Windows windows = get_search_windows(opts_parsed);
+    Wildcards wildcards = get_wildcards(opts_parsed);
+    bool verbose = opts_parsed["v"].as<bool>();
+    int64_t n_threads = opts_parsed["t"].as<int64_t>();
+
+    with_barcode_matcher(opts_parsed, verbose, [&](const auto* matcher, const Barcode_Patterns& bp){
+        filter_barcodes(seq_file, matcher, bp, windows, wildcards, output_file, n_threads);
+    });
+
+    return 0;
+}
+
+int index_main(int argc, char** argv){
+    cxxopts::Options opts(argv[0], "Build a barcode index that analyze and filter can load with -x.");
+
+    opts.add_options()
+        ("b", "A file containing the barcodes, one per line. Do not give reverse complements.", cxxopts::value<string>())
+        ("o", "Output file.", cxxopts::value<string>())
+        ("t,threads", "Number of threads used to build the barcode matcher.", cxxopts::value<int64_t>()->default_value("1"))
+        ("h,help", "Print usage")
+    ;
+
+    auto opts_parsed = opts.parse(argc, argv);
+
+    if (argc == 1 || opts_parsed.count("help")){
+        std::cerr << opts.help() << std::endl;
+        return 1;
+    }
+
     string barcode_file = opts_parsed["b"].as<string>();
     string output_file = opts_parsed["o"].as<string>();
+    int64_t n_threads = opts_parsed["t"].as<int64_t>();
 
-    filter_barcodes(seq_file, barcode_file, output_file);
+    write_barcode_index(barcode_file, output_file, n_threads);
 
     return 0;
 }
@@ -223,7 +1161,7 @@ int filter_main(int argc, char** argv){
 
 int main(int argc, char** argv){
 
-    vector<string> commands = {"analyze", "filter"};
+    vector<string> commands = {"analyze", "filter", "index"};
     if(argc == 1 || argv[1] == string("--help") || argv[1] == string("-h")){
         cerr << "Available commands: " << endl;
         for(string S : commands) cerr << "   " << argv[0] << " " << S << endl;
@@ -239,6 +1177,7 @@ int main(int argc, char** argv){
 
     if(command == "analyze") analyze_main(argc, argv);
     else if(command == "filter") filter_main(argc, argv);
+    else if(command == "index") index_main(argc, argv);
     else{
         cerr << "Invalid command " << command << endl;
         return 1;
@@ -1,7 +1,15 @@
 #pragma once
 
 #include <fstream>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "zstr/zstr.hpp"
+#include "background_inflater.hh"
 
 // The c++ ifstream and ofstream classes are buffered. But each read involves a virtual function
 // call, which can be slow if the reads or writes are in small chunks. The buffer is also pretty
@@ -9,6 +17,15 @@
 // only when the buffer is full, which results in far less virtual function calls and better performance.
 // These classes take as template parameter the underlying ifstream or ofstream, so you can use any
 // stream that has the same interface as the std streams.
+//
+// A Buffered_ifstream over a std::ifstream memory-maps regular files instead of reading them,
+// so that the parsers work directly on the page cache without copying the file into the buffer.
+// Pipes and other special files, and files that can not be mapped, are read through the stream.
+//
+// If the file is opened as gzipped, it is decompressed on a background thread by a
+// Background_Inflater instead, with n_threads threads for BGZF files, and the
+// underlying ifstream is not used. Likewise a gzipped Buffered_ofstream writes
+// through a zstr::ofstream.
 
 typedef long long LL;
 
@@ -24,10 +41,58 @@ private:
     vector<char> buf;
     LL buf_cap = 1 << 20;
 
+    char* base = nullptr; // buf.data(), or the start of the mapping
     LL buf_pos = 0;
     LL buf_size = 0;
     bool is_eof = false;
     ifstream_t* stream = nullptr;
+    std::shared_ptr<char> mapping; // The whole file if it is memory-mapped
+    std::unique_ptr<Background_Inflater> inflater; // Decompresses the file if it is gzipped
+
+    // Reads up to n bytes from the stream or the inflater. Returns 0 only at the end of the file.
+    LL read_from_source(char* dest, LL n){
+        if(inflater) return inflater->read(dest, n);
+        stream->read(dest, n);
+        return stream->gcount();
+    }
+
+    bool has_source() const {return stream != nullptr || inflater != nullptr;}
+
+    void open_source(const string& filename, ios_base::openmode mode, bool gzipped, int64_t n_threads){
+        if(gzipped) inflater = std::make_unique<Background_Inflater>(filename, n_threads);
+        else{
+            if(try_to_map(filename)) return;
+            stream = new ifstream_t(filename, mode);
+            if(!stream->good()) throw std::runtime_error("Error opening file " + filename);
+        }
+        buf.resize(buf_cap);
+        base = buf.data();
+    }
+
+    // Maps the file read-only if it is a non-empty regular file. Returns false if
+    // the file should be streamed instead.
+    bool try_to_map(const string& filename){
+        if(!std::is_same<ifstream_t, std::ifstream>::value) return false;
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd == -1) return false;
+        struct stat st;
+        if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0){
+            ::close(fd);
+            return false;
+        }
+        size_t size = st.st_size;
+        void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(addr == MAP_FAILED) return false;
+        madvise(addr, size, MADV_SEQUENTIAL);
+        madvise(addr, size, MADV_WILLNEED);
+        mapping = std::shared_ptr<char>((char*)addr, [size](char* p){ munmap(p, size); });
+        base = mapping.get();
+        buf_pos = 0;
+        buf_size = size;
+        is_eof = false;
+        return true;
+    }
 
 public:
 
@@ -39,10 +104,10 @@ public:
         delete stream;
     }
 
-    Buffered_ifstream(string filename, ios_base::openmode mode = ios_base::in) {
-        stream = new ifstream_t(filename, mode);
-        if(!stream->good()) throw std::runtime_error("Error opening file " + filename);
-        buf.resize(buf_cap);
+    // If gzipped is true, the file is decompressed on a background thread, with
+    // n_threads threads if it is in the BGZF format
+    Buffered_ifstream(string filename, ios_base::openmode mode = ios_base::in, bool gzipped = false, int64_t n_threads = 1) {
+        open_source(filename, mode, gzipped, n_threads);
     }
 
     // Reads one byte to the given location.
@@ -50,15 +115,18 @@ public:
     bool get(char* c){
         if(is_eof) return false;
         if(buf_pos == buf_size){
-            stream->read(buf.data(), buf_cap);
-            buf_size = stream->gcount();
+            if(!has_source()){
+                is_eof = true;
+                return false;
+            }
+            buf_size = read_from_source(buf.data(), buf_cap);
             buf_pos = 0;
             if(buf_size == 0){
                 is_eof = true;
                 return false;
             }
         }
-        *c = buf[buf_pos++];
+        *c = base[buf_pos++];
         return true;
     }
 
@@ -87,25 +155,65 @@ public:
         return is_eof;
     }
 
-    void open(string filename, ios_base::openmode mode = ios_base::in){
-        delete stream;
-        stream = new ifstream_t(filename, mode);
-        buf.resize(buf_cap);
-        if(!stream->good()) throw std::runtime_error("Error opening file " + filename);
+    // Block access for parsers: the bytes that have not been consumed yet are
+    // data()[0..available()). Parsers find what they need in that range, calling
+    // refill for more, and then consume the bytes they used. Unless the file is
+    // memory-mapped, the bytes may also be modified in place through writable_data().
+    const char* data() const {return base + buf_pos;}
+
+    char* writable_data() {return is_mapped() ? nullptr : base + buf_pos;}
+
+    // If true, the whole file is available from the start and refill never reads more
+    bool is_mapped() const {return mapping != nullptr;}
+
+    LL available() const {return buf_size - buf_pos;}
+
+    void consume(LL n){buf_pos += n;}
+
+    // Moves the bytes that have not been consumed to the start of the buffer and
+    // reads more bytes after them, doubling the buffer if it is already full of
+    // them. Returns false if the stream has no more bytes. Pointers from data() are
+    // invalid after this, but offsets from data() stay valid.
+    bool refill(){
+        if(is_eof || !has_source()) return false;
+        LL n_kept = buf_size - buf_pos;
+        if(buf_pos > 0) memmove(buf.data(), buf.data() + buf_pos, n_kept);
+        else if(n_kept == buf_cap){
+            buf_cap *= 2;
+            buf.resize(buf_cap);
+            base = buf.data();
+        }
+        buf_pos = 0;
+        buf_size = n_kept;
+        LL n_read = read_from_source(buf.data() + buf_size, buf_cap - buf_size);
+        buf_size += n_read;
+        if(n_read == 0){
+            if(buf_size == 0) is_eof = true;
+            return false;
+        }
+        return true;
+    }
+
+    void open(string filename, ios_base::openmode mode = ios_base::in, bool gzipped = false, int64_t n_threads = 1){
+        close();
         buf_size = 0;
         buf_pos = 0;
         is_eof = false;
+        open_source(filename, mode, gzipped, n_threads);
     }
 
     void close(){
         delete stream;
         stream = nullptr;
+        mapping.reset();
+        inflater.reset();
     }
 
 
     void set_buffer_capacity(LL cap){
         this->buf_cap = cap;
         buf.resize(buf_cap);
+        if(!is_mapped()) base = buf.data();
     }
 
 };
@@ -122,14 +230,26 @@ private:
     LL buf_size = 0;
     LL buf_cap = 1 << 20;
     ofstream_t* stream = nullptr;
+    std::unique_ptr<zstr::ofstream> gz_stream; // Used instead of stream if the file is gzipped
 
     void empty_internal_buffer_to_stream(){
-        if(stream){
+        if(gz_stream){
+            gz_stream->write(buf.data(), buf_size);
+            buf_size = 0;
+        } else if(stream){
             stream->write(buf.data(), buf_size);
             buf_size = 0;
         }
     }
 
+    void open_stream(const string& filename, ios_base::openmode mode, bool gzipped){
+        if(gzipped) gz_stream = std::make_unique<zstr::ofstream>(filename, mode);
+        else{
+            stream = new ofstream_t(filename, mode);
+            if(!stream->good()) throw std::runtime_error("Error opening file " + filename);
+        }
+    }
+
 public:
 
     Buffered_ofstream(Buffered_ofstream&&) = default; // Movable
@@ -137,9 +257,9 @@ public:
 
     Buffered_ofstream(){}
 
-    Buffered_ofstream(string filename, ios_base::openmode mode = ios_base::out){
-        stream = new ofstream_t(filename, mode);
-        if(!stream->good()) throw std::runtime_error("Error opening file " + filename);
+    // If gzipped is true, the output is compressed with zlib
+    Buffered_ofstream(string filename, ios_base::openmode mode = ios_base::out, bool gzipped = false){
+        open_stream(filename, mode, gzipped);
         buf.resize(buf_cap);
     }
 
@@ -155,10 +275,9 @@ public:
         }
     }
 
-    void open(string filename, ios_base::openmode mode = ios_base::out){
-        delete stream;
-        stream = new ofstream_t(filename, mode);
-        if(!stream->good()) throw std::runtime_error("Error opening file " + filename);
+    void open(string filename, ios_base::openmode mode = ios_base::out, bool gzipped = false){
+        close();
+        open_stream(filename, mode, gzipped);
         buf.resize(buf_cap);
         buf_size = 0;
     }
@@ -167,12 +286,14 @@ public:
         empty_internal_buffer_to_stream();
         delete stream; // Flushes also
         stream = nullptr;
+        gz_stream.reset(); // Finishes the gzip member
     }
 
-    // Flush the internal buffer AND the file stream
+    // Flush the internal buffer AND the file stream. A gzip stream is only flushed
+    // when it is closed, so for gzipped files only the internal buffer is flushed.
     void flush(){
         empty_internal_buffer_to_stream();
-        stream->flush();
+        if(stream) stream->flush();
     }
 
     ~Buffered_ofstream(){
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+// Exact matcher for a set of patterns that all have the same length k <= 32 and
+// consist of the letters A, C, G and T in either case. A 2-bit packed k-mer and
+// its reverse complement are rolled across the text, and the canonical k-mer of
+// each window, the smaller of the two, is looked up in an open-addressing hash
+// table keyed by the canonical k-mers of the patterns. A barcode and its reverse
+// complement share one key, so one lookup covers both strands and the table has
+// half as many keys as there are patterns. Reports the same matches as the
+// Aho-Corasick automata, with pattern indices being positions in the pattern list.
+// A bitmap over finer hash buckets than the table rejects almost all windows that
+// are not patterns before the table is touched.
+class Kmer_Hash_Matcher{
+
+private:
+
+    struct Entry{
+        uint64_t kmer;
+        uint32_t ids_begin; // The patterns with this canonical k-mer are ids[ids_begin..ids_begin+n_ids)
+        uint32_t n_ids; // Zero for an empty entry
+    };
+
+    int64_t k;
+    uint64_t kmer_mask;
+    vector<Entry> table; // Capacity is a power of two
+    uint64_t table_mask;
+    int64_t hash_shift;
+    vector<uint32_t> ids; // Pattern indices, with reverse_flag set if the pattern is not the canonical k-mer itself
+    vector<uint64_t> filter; // Bit h is set iff some pattern has hash prefix h
+    int64_t filter_shift;
+    uint8_t code[256]; // Byte to 2-bit code, or 4 for bytes that are not ACGT
+
+    static constexpr uint32_t reverse_flag = uint32_t(1) << 31;
+
+    void init_code_table(){
+        for(int64_t c = 0; c < 256; c++) code[c] = 4;
+        code['A'] = code['a'] = 0;
+        code['C'] = code['c'] = 1;
+        code['G'] = code['g'] = 2;
+        code['T'] = code['t'] = 3;
+    }
+
+    int64_t slot_of(uint64_t kmer) const {
+        return (kmer * 0x9E3779B97F4A7C15ULL) >> hash_shift; // Fibonacci hashing
+    }
+
+    bool maybe_contains(uint64_t kmer) const {
+        uint64_t h = (kmer * 0x9E3779B97F4A7C15ULL) >> filter_shift;
+        return (filter[h >> 6] >> (h & 63)) & 1;
+    }
+
+    uint64_t reverse_complement(uint64_t kmer) const {
+        uint64_t rc = 0;
+        for(int64_t i = 0; i < k; i++){
+            rc = (rc << 2) | (3 - (kmer & 3));
+            kmer >>= 2;
+        }
+        return rc;
+    }
+
+    // Rolls the k-mer and its reverse complement by one character x
+    void roll(uint64_t& kmer, uint64_t& rc_kmer, uint8_t x) const {
+        kmer = ((kmer << 2) | x) & kmer_mask;
+        rc_kmer = (rc_kmer >> 2) | (uint64_t(3 - x) << (2*k - 2));
+    }
+
+    const Entry* find(uint64_t kmer) const {
+        for(int64_t i = slot_of(kmer); ; i = (i + 1) & table_mask){
+            if(table[i].n_ids == 0) return nullptr;
+            if(table[i].kmer == kmer) return &table[i];
+        }
+    }
+
+public:
+
+    // Returns true if the patterns can be given to the constructor
+    static bool supports(const vector<string>& patterns){
+        if(patterns.empty() || patterns[0].size() == 0 || patterns[0].size() > 32) return false;
+        for(const string& P : patterns){
+            if(P.size() != patterns[0].size()) return false;
+            for(char c : P) if(string("ACGTacgt").find(c) == string::npos) return false;
+        }
+        return true;
+    }
+
+    Kmer_Hash_Matcher(const vector<string>& patterns){
+        if(!supports(patterns)) throw std::invalid_argument("The k-mer matcher needs non-empty ACGT patterns of equal length at most 32");
+        init_code_table();
+        k = patterns[0].size();
+        kmer_mask = (k == 32) ? ~uint64_t(0) : ((uint64_t(1) << (2*k)) - 1);
+
+        vector<uint64_t> kmers(patterns.size()); // Canonical k-mers
+        vector<bool> is_reverse(patterns.size());
+        for(int64_t i = 0; i < (int64_t)patterns.size(); i++){
+            uint64_t x = 0;
+            for(char c : patterns[i]) x = (x << 2) | code[(unsigned char)c];
+            uint64_t rc = reverse_complement(x);
+            kmers[i] = min(x, rc);
+            is_reverse[i] = (x != kmers[i]);
+        }
+        vector<uint64_t> distinct = kmers;
+        std::sort(distinct.begin(), distinct.end());
+        int64_t n_keys = std::unique(distinct.begin(), distinct.end()) - distinct.begin();
+
+        // At most half full
+        int64_t log_capacity = 1;
+        while((int64_t(1) << log_capacity) < 2 * n_keys) log_capacity++;
+        table.resize(int64_t(1) << log_capacity, {0, 0, 0});
+        table_mask = table.size() - 1;
+        hash_shift = 64 - log_capacity;
+        filter_shift = hash_shift - 5; // 64 filter bits per table slot
+        filter.resize((int64_t(1) << (log_capacity + 5)) / 64);
+
+        // Count the patterns of each distinct canonical k-mer, then place their ids contiguously
+        for(uint64_t x : kmers){
+            uint64_t h = (x * 0x9E3779B97F4A7C15ULL) >> filter_shift;
+            filter[h >> 6] |= uint64_t(1) << (h & 63);
+            int64_t i = slot_of(x);
+            while(table[i].n_ids != 0 && table[i].kmer != x) i = (i + 1) & table_mask;
+            table[i].kmer = x;
+            table[i].n_ids++;
+        }
+        uint32_t sum = 0;
+        for(Entry& e : table){
+            e.ids_begin = sum;
+            sum += e.n_ids;
+        }
+        ids.resize(patterns.size());
+        vector<uint32_t> n_filled(table.size());
+        for(int64_t p = 0; p < (int64_t)patterns.size(); p++){
+            int64_t i = find(kmers[p]) - table.data();
+            ids[table[i].ids_begin + n_filled[i]++] = p | (is_reverse[p] ? reverse_flag : 0);
+        }
+    }
+
+    int64_t get_k() const {return k;}
+
+    // Size of the hash table in bytes
+    int64_t size() const {return table.size() * sizeof(Entry) + ids.size() * sizeof(uint32_t) + filter.size() * sizeof(uint64_t);}
+
+    // Calls visit(pattern_index, end_pos) for every pattern occurrence in
+    // text[0..len), in order of end position.
+    template<typename Visitor>
+    void scan(const char* text, int64_t len, Visitor&& visit) const {
+        uint64_t kmer = 0, rc_kmer = 0;
+        int64_t run = 0; // Number of ACGT characters ending at the current position
+        for(int64_t pos = 0; pos < len; pos++){
+            uint8_t x = code[(unsigned char)text[pos]];
+            if(x == 4){
+                run = 0;
+                continue;
+            }
+            roll(kmer, rc_kmer, x);
+            uint64_t canonical = min(kmer, rc_kmer);
+            if(++run >= k && maybe_contains(canonical)){
+                const Entry* e = find(canonical);
+                if(e != nullptr){
+                    // The window is the pattern if both are or both are not the canonical k-mer
+                    uint32_t window_flag = (kmer != canonical) ? reverse_flag : 0;
+                    for(uint32_t i = e->ids_begin; i < e->ids_begin + e->n_ids; i++){
+                        if((ids[i] & reverse_flag) == window_flag) visit(ids[i] & ~reverse_flag, pos);
+                    }
+                }
+            }
+        }
+    }
+
+    // Returns true iff some pattern occurs in text[0..len)
+    bool contains_any(const char* text, int64_t len) const {
+        uint64_t kmer = 0, rc_kmer = 0;
+        int64_t run = 0;
+        for(int64_t pos = 0; pos < len; pos++){
+            uint8_t x = code[(unsigned char)text[pos]];
+            if(x == 4){
+                run = 0;
+                continue;
+            }
+            roll(kmer, rc_kmer, x);
+            uint64_t canonical = min(kmer, rc_kmer);
+            if(++run >= k && maybe_contains(canonical)){
+                const Entry* e = find(canonical);
+                if(e == nullptr) continue;
+                uint32_t window_flag = (kmer != canonical) ? reverse_flag : 0;
+                for(uint32_t i = e->ids_begin; i < e->ids_begin + e->n_ids; i++){
+                    if((ids[i] & reverse_flag) == window_flag) return true;
+                }
+            }
+        }
+        return false;
+    }
+
+};
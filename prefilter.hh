@@ -0,0 +1,231 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <immintrin.h>
+
+using namespace std;
+
+// A Teddy-style prefilter (as in Hyperscan) for a set of patterns. The first m
+// bytes of every pattern are its fingerprint, and the fingerprints are split into
+// 8 buckets. For each fingerprint position j there is a 16-entry table from the low
+// nibble of a byte to the set of buckets that have a fingerprint with that low
+// nibble at position j. A text position can start a pattern only if the AND of the
+// tables over the m following bytes is non-zero. With AVX2 this is computed for 32
+// positions at once with one shuffle per fingerprint byte.
+//
+// Only the low nibble is looked at because it already separates A, C, G, T and N,
+// and it is the same for upper and lower case letters, so the prefilter is case
+// insensitive like the automata. Any other byte only adds candidates, so no match
+// is ever lost.
+class Teddy_Prefilter{
+
+private:
+
+    int64_t m = 0; // Fingerprint length
+    int64_t max_pattern_len = 0;
+    uint8_t tables[16][16] = {}; // tables[j][nibble] = bit set of buckets
+    double candidate_rate = 1; // Expected candidates per position of uniform random ACGT text
+    bool selective = false; // The fingerprints are selective enough to be worth using
+    bool enabled = false; // Selective, and the CPU has AVX2
+
+    static constexpr int64_t max_m = 16;
+    static constexpr int64_t n_buckets = 8;
+    static constexpr int64_t max_patterns = 1024; // With more, the buckets are too mixed to be selective
+
+    // Expected fraction of positions of uniform random ACGT text that are candidates
+    // when the fingerprints are the first m bytes of the sorted patterns split into
+    // contiguous buckets.
+    static double estimate_candidate_rate(const vector<string>& sorted, int64_t m, uint8_t (*tables)[16]){
+        for(int64_t j = 0; j < m; j++) for(int64_t c = 0; c < 16; c++) tables[j][c] = 0;
+        int64_t n = sorted.size();
+        for(int64_t i = 0; i < n; i++){
+            int64_t bucket = i * n_buckets / n;
+            for(int64_t j = 0; j < m; j++) tables[j][sorted[i][j] & 0x0F] |= 1 << bucket;
+        }
+        double rate = 0;
+        for(int64_t b = 0; b < n_buckets; b++){
+            double p = 1;
+            for(int64_t j = 0; j < m; j++){
+                int64_t n_accepted = 0;
+                for(char c : {'A', 'C', 'G', 'T'}) n_accepted += (tables[j][c & 0x0F] >> b) & 1;
+                p *= n_accepted / 4.0;
+            }
+            rate += p;
+        }
+        return rate;
+    }
+
+    // Bit set of buckets that may have a pattern starting at text[i]. Needs i + m <= len.
+    uint8_t candidate_buckets(const char* text, int64_t i) const {
+        uint8_t x = 0xFF;
+        for(int64_t j = 0; j < m; j++) x &= tables[j][text[i+j] & 0x0F];
+        return x;
+    }
+
+    // Bit t of the result is set iff text[i+t] is a candidate, for t in [0, 32).
+    // Needs i + m - 1 + 32 <= len.
+    __attribute__((target("avx2")))
+    uint32_t candidate_mask_avx2(const char* text, int64_t i) const {
+        const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+        __m256i x = _mm256_set1_epi8(-1);
+        for(int64_t j = 0; j < m; j++){
+            __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tables[j]));
+            __m256i bytes = _mm256_loadu_si256((const __m256i*)(text + i + j));
+            x = _mm256_and_si256(x, _mm256_shuffle_epi8(table, _mm256_and_si256(bytes, low_nibble)));
+        }
+        return ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_setzero_si256()));
+    }
+
+public:
+
+    // Candidate rates above this are not worth the extra pass over the reads
+    static constexpr double max_candidate_rate = 1.0 / 256;
+
+    // The state of a prefilter apart from the CPU check, in a fixed layout, so that
+    // a barcode index can store it and the patterns are not needed to load it
+    struct Stored{
+        int64_t m;
+        int64_t max_pattern_len;
+        double candidate_rate;
+        uint8_t tables[16][16];
+        uint64_t selective;
+    };
+
+    Teddy_Prefilter(const vector<string>& patterns){
+        if(patterns.empty() || (int64_t)patterns.size() > max_patterns) return;
+        vector<string> sorted = patterns;
+        std::sort(sorted.begin(), sorted.end());
+        sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+        int64_t min_len = sorted[0].size();
+        for(const string& P : sorted){
+            min_len = min(min_len, (int64_t)P.size());
+            max_pattern_len = max(max_pattern_len, (int64_t)P.size());
+        }
+
+        // Take the shortest fingerprint that is selective enough
+        for(m = 1; m <= min(min_len, max_m); m++){
+            candidate_rate = estimate_candidate_rate(sorted, m, tables);
+            if(candidate_rate <= max_candidate_rate){
+                selective = true;
+                enabled = __builtin_cpu_supports("avx2");
+                return;
+            }
+        }
+        m = 0;
+    }
+
+    Teddy_Prefilter(const Stored& stored) : m(stored.m), max_pattern_len(stored.max_pattern_len), candidate_rate(stored.candidate_rate), selective(stored.selective) {
+        std::copy(&stored.tables[0][0], &stored.tables[0][0] + 16 * 16, &tables[0][0]);
+        enabled = selective && __builtin_cpu_supports("avx2");
+    }
+
+    Stored get_stored() const {
+        Stored stored = {};
+        stored.m = m;
+        stored.max_pattern_len = max_pattern_len;
+        stored.candidate_rate = candidate_rate;
+        std::copy(&tables[0][0], &tables[0][0] + 16 * 16, &stored.tables[0][0]);
+        stored.selective = selective;
+        return stored;
+    }
+
+    // False if the patterns are too short or too many for the fingerprints to be
+    // selective, or if the CPU does not have AVX2. Then the prefilter must not be used.
+    bool is_enabled() const {return enabled;}
+
+    int64_t get_fingerprint_length() const {return m;}
+
+    double get_candidate_rate() const {return candidate_rate;}
+
+    // Finds the first and the last candidate position in text[0..len). Every pattern
+    // occurrence starts at a candidate position. Returns false if there are none.
+    bool find_candidate_range(const char* text, int64_t len, int64_t& first, int64_t& last) const {
+        int64_t end = len - m + 1; // Candidates are in [0, end)
+        int64_t vector_end = end - 31; // 32-position blocks start in [0, vector_end)
+
+        first = -1;
+        int64_t i = 0;
+        for(; i < vector_end; i += 32){
+            uint32_t mask = candidate_mask_avx2(text, i);
+            if(mask != 0){
+                first = i + __builtin_ctz(mask);
+                break;
+            }
+        }
+        if(first == -1){
+            for(; i < end; i++) if(candidate_buckets(text, i)){
+                first = i;
+                break;
+            }
+            if(first == -1) return false;
+        }
+
+        // Search the last candidate backwards from the end
+        for(last = end - 1; last > first && last >= vector_end; last--){
+            if(candidate_buckets(text, last)) return true;
+        }
+        for(; last - 31 > first; last -= 32){
+            uint32_t mask = candidate_mask_avx2(text, last - 31);
+            if(mask != 0){
+                last = last - __builtin_clz(mask);
+                return true;
+            }
+        }
+        // Fewer than 32 positions are left in (first, last]
+        for(; last > first; last--){
+            if(candidate_buckets(text, last)) return true;
+        }
+        return true;
+    }
+
+    // Calls matcher.scan only on the part of the text between the first and the last
+    // candidate position, and shifts the end positions back to the whole text.
+    template<typename matcher_t, typename Visitor>
+    void scan(const matcher_t& matcher, const char* text, int64_t len, Visitor&& visit) const {
+        int64_t first, last;
+        if(!find_candidate_range(text, len, first, last)) return;
+        int64_t window_len = min(len, last + max_pattern_len) - first;
+        matcher.scan(text + first, window_len, [&](auto pattern_idx, auto end_pos){
+            visit(pattern_idx, end_pos + first);
+        });
+    }
+
+    template<typename matcher_t>
+    bool contains_any(const matcher_t& matcher, const char* text, int64_t len) const {
+        int64_t first, last;
+        if(!find_candidate_range(text, len, first, last)) return false;
+        int64_t window_len = min(len, last + max_pattern_len) - first;
+        return matcher.contains_any(text + first, window_len);
+    }
+
+};
+
+// Runs a Teddy_Prefilter in front of an exact matcher, so that reads without
+// candidate positions are skipped and only the candidate range of the other reads
+// is given to the matcher. Has the same scan and contains_any as the matchers.
+template<typename matcher_t>
+class Prefiltered_Matcher{
+
+private:
+
+    const Teddy_Prefilter* prefilter;
+    const matcher_t* matcher;
+
+public:
+
+    Prefiltered_Matcher(const Teddy_Prefilter* prefilter, const matcher_t* matcher) : prefilter(prefilter), matcher(matcher) {}
+
+    template<typename Visitor>
+    void scan(const char* text, int64_t len, Visitor&& visit) const {
+        prefilter->scan(*matcher, text, len, visit);
+    }
+
+    bool contains_any(const char* text, int64_t len) const {
+        return prefilter->contains_any(*matcher, text, len);
+    }
+
+};
@@ -1,6 +1,16 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <immintrin.h>
+
+using namespace std;
+
 vector<int64_t> get_border_array(const char* P, int64_t P_len){
     vector<int64_t> B(P_len+1);
     if(B.size() == 1) return B;
@@ -38,24 +48,466 @@ int64_t kmp(const char* P, int64_t P_len, const char* S, int64_t S_len, const ve
     return matches;
 }
 
-// TODO: untested for patterns that have length that is not a multiple of 8
-int64_t bit_parallel_matching(const char* P, const int64_t P_len, const char* S, const int64_t S_len){
-    int64_t n_matches = 0;
-    for(int64_t start = 0; start < S_len - P_len + 1; start++){
-        bool good = true;
-        int64_t n_words = P_len/8;
-        for(int64_t w = 0; w < n_words; w++){ // Word-parallel 8 bytes at a time
-            good &= (*reinterpret_cast<const uint64_t*>(P + w*8) == 
-                     *reinterpret_cast<const uint64_t*>(S + start + w*8));
+// A pattern occurrence found by the matchers below, which search one pattern at
+// a time. Sorting them with sort_in_automaton_order gives the order in which the
+// Aho-Corasick automata report them: by end position, longer patterns first, and
+// then by pattern index.
+struct Pattern_Match{
+    int64_t end;
+    uint32_t pattern;
+};
+
+inline void sort_in_automaton_order(vector<Pattern_Match>& matches, const vector<string>& patterns){
+    std::sort(matches.begin(), matches.end(), [&](const Pattern_Match& a, const Pattern_Match& b){
+        if(a.end != b.end) return a.end < b.end;
+        if(patterns[a.pattern].size() != patterns[b.pattern].size()) return patterns[a.pattern].size() > patterns[b.pattern].size();
+        return a.pattern < b.pattern;
+    });
+}
+
+inline char to_lower_ascii(char c){
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+// Exact matcher for a few patterns. With AVX2, the text is processed in blocks of
+// 32 start positions: the first f bytes at each of the 32 offsets are loaded and
+// lower-cased once, where f is at most 6 and at most the shortest pattern length,
+// and every pattern compares its first f characters against all 32 offsets at
+// once, without branches. The few offsets that pass are checked one by one. Case
+// insensitive like the Aho-Corasick automata, and reports the matches in the same
+// order. Empty patterns never match.
+class Bit_Parallel_Matcher{
+
+private:
+
+    static constexpr int64_t max_patterns = 16;
+    static constexpr int64_t max_prefix = 6; // Leaves few enough candidates on DNA to check them one by one
+
+    vector<string> patterns; // Lower-cased non-empty patterns
+    vector<uint32_t> pattern_ids; // Indices of the non-empty patterns in the input
+    int64_t f = 0; // Length of the prefix compared with SIMD
+    bool use_avx2;
+
+    __attribute__((target("avx2")))
+    static __m256i to_lower(__m256i x){
+        __m256i is_upper = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+        return _mm256_or_si256(x, _mm256_and_si256(is_upper, _mm256_set1_epi8(0x20)));
+    }
+
+    bool occurs_at(const char* text, int64_t len, int64_t p, int64_t start, int64_t from = 0) const {
+        const string& P = patterns[p];
+        if(start + (int64_t)P.size() > len) return false;
+        for(int64_t j = from; j < (int64_t)P.size(); j++) if(to_lower_ascii(text[start + j]) != P[j]) return false;
+        return true;
+    }
+
+    // Reports the occurrences that start in the block of 32 positions at text + i,
+    // whose first F + 31 bytes are at block.
+    template<int64_t F, typename Report>
+    __attribute__((target("avx2")))
+    bool search_block(const char* block, const char* text, int64_t len, int64_t i, Report&& report) const {
+        __m256i v[F];
+        for(int64_t j = 0; j < F; j++) v[j] = to_lower(_mm256_loadu_si256((const __m256i*)(block + j)));
+        for(int64_t p = 0; p < (int64_t)patterns.size(); p++){
+            const char* P = patterns[p].data();
+            __m256i eq = _mm256_cmpeq_epi8(v[0], _mm256_set1_epi8(P[0]));
+            for(int64_t j = 1; j < F; j++) eq = _mm256_and_si256(eq, _mm256_cmpeq_epi8(v[j], _mm256_set1_epi8(P[j])));
+            for(uint32_t mask = _mm256_movemask_epi8(eq); mask != 0; mask &= mask - 1){
+                int64_t start = i + __builtin_ctz(mask);
+                if(occurs_at(text, len, p, start, F) && report(p, start + patterns[p].size() - 1)) return true;
+            }
+        }
+        return false;
+    }
+
+    template<int64_t F, typename Report>
+    bool search_blocks(const char* text, int64_t len, Report&& report) const {
+        int64_t i = 0;
+        for(; i + 32 + F - 1 <= len; i += 32){
+            if(search_block<F>(text + i, text, len, i, report)) return true;
+        }
+        if(i < len){
+            char tail[32 + F] = {};
+            memcpy(tail, text + i, len - i);
+            return search_block<F>(tail, text, len, i, report);
+        }
+        return false;
+    }
+
+    // Calls report(p, end_pos) for the occurrences of the patterns in text[0..len).
+    // Stops early if report returns true. The last bytes are copied to a zero-padded
+    // buffer so that nothing past the end of the text is read.
+    template<typename Report>
+    bool for_each_occurrence(const char* text, int64_t len, Report&& report) const {
+        if(use_avx2){
+            switch(f){
+                case 1: return search_blocks<1>(text, len, report);
+                case 2: return search_blocks<2>(text, len, report);
+                case 3: return search_blocks<3>(text, len, report);
+                case 4: return search_blocks<4>(text, len, report);
+                case 5: return search_blocks<5>(text, len, report);
+                default: return search_blocks<6>(text, len, report);
+            }
+        }
+        for(int64_t i = 0; i < len; i++){
+            for(int64_t p = 0; p < (int64_t)patterns.size(); p++){
+                if(occurs_at(text, len, p, i) && report(p, i + patterns[p].size() - 1)) return true;
+            }
+        }
+        return false;
+    }
+
+public:
+
+    // Returns true if there are few enough patterns for this matcher
+    static bool supports(const vector<string>& patterns){
+        return !patterns.empty() && (int64_t)patterns.size() <= max_patterns;
+    }
+
+    Bit_Parallel_Matcher(const vector<string>& patterns) : use_avx2(__builtin_cpu_supports("avx2")) {
+        if(!supports(patterns)) throw std::invalid_argument("The bit-parallel matcher takes at most 16 patterns");
+        f = max_prefix;
+        for(int64_t i = 0; i < (int64_t)patterns.size(); i++){
+            if(patterns[i].empty()) continue;
+            string P = patterns[i];
+            for(char& c : P) c = to_lower_ascii(c);
+            this->patterns.push_back(P);
+            pattern_ids.push_back(i);
+            f = min(f, (int64_t)P.size());
+        }
+    }
+
+    // Size of the patterns in bytes
+    int64_t size() const {
+        int64_t total = 0;
+        for(const string& P : patterns) total += P.size();
+        return total;
+    }
+
+    // Calls visit(pattern_index, end_pos) for every pattern occurrence in
+    // text[0..len), in the same order as the automata.
+    template<typename Visitor>
+    void scan(const char* text, int64_t len, Visitor&& visit) const {
+        thread_local vector<Pattern_Match> matches;
+        matches.clear();
+        for_each_occurrence(text, len, [&](int64_t p, int64_t end){
+            matches.push_back({end, (uint32_t)p});
+            return false;
+        });
+        sort_in_automaton_order(matches, patterns);
+        for(const Pattern_Match& m : matches) visit(pattern_ids[m.pattern], m.end);
+    }
+
+    // Returns true iff some pattern occurs in text[0..len)
+    bool contains_any(const char* text, int64_t len) const {
+        return for_each_occurrence(text, len, [](int64_t, int64_t){return true;});
+    }
+
+};
+
+// Runs the Knuth-Morris-Pratt algorithm of kmp for each pattern in turn. Case
+// insensitive like the Aho-Corasick automata, and reports the matches in the same
+// order. Empty patterns never match. Mostly useful as a simple reference engine.
+class Kmp_Matcher{
+
+private:
+
+    vector<string> patterns; // Lower-cased non-empty patterns
+    vector<uint32_t> pattern_ids; // Indices of the non-empty patterns in the input
+    vector<vector<int64_t>> border_arrays;
+
+    // Calls report(end_pos) for each occurrence of pattern p. Stops early if report
+    // returns true.
+    template<typename Report>
+    bool for_each_occurrence(int64_t p, const char* S, int64_t S_len, Report&& report) const {
+        const char* P = patterns[p].data();
+        int64_t P_len = patterns[p].size();
+        const vector<int64_t>& border_array = border_arrays[p];
+        int64_t length = 0;
+        for(int64_t i = 0; i < S_len; i++){
+            char c = to_lower_ascii(S[i]);
+            while(length == P_len || P[length] != c){
+                length = border_array[length];
+                if(length == 0) break;
+            }
+            if(c == P[length]) length++;
+            if(length == P_len && report(i)) return true;
+        }
+        return false;
+    }
+
+public:
+
+    Kmp_Matcher(const vector<string>& patterns){
+        for(int64_t i = 0; i < (int64_t)patterns.size(); i++){
+            if(patterns[i].empty()) continue;
+            string P = patterns[i];
+            for(char& c : P) c = to_lower_ascii(c);
+            border_arrays.push_back(get_border_array(P.data(), P.size()));
+            this->patterns.push_back(P);
+            pattern_ids.push_back(i);
         }
+    }
+
+    // Size of the patterns and the border arrays in bytes
+    int64_t size() const {
+        int64_t total = 0;
+        for(int64_t p = 0; p < (int64_t)patterns.size(); p++) total += patterns[p].size() + border_arrays[p].size() * sizeof(int64_t);
+        return total;
+    }
+
+    // Calls visit(pattern_index, end_pos) for every pattern occurrence in
+    // text[0..len), in the same order as the automata.
+    template<typename Visitor>
+    void scan(const char* text, int64_t len, Visitor&& visit) const {
+        thread_local vector<Pattern_Match> matches;
+        matches.clear();
+        for(int64_t p = 0; p < (int64_t)patterns.size(); p++){
+            for_each_occurrence(p, text, len, [&](int64_t end){
+                matches.push_back({end, (uint32_t)p});
+                return false;
+            });
+        }
+        sort_in_automaton_order(matches, patterns);
+        for(const Pattern_Match& m : matches) visit(pattern_ids[m.pattern], m.end);
+    }
 
-        // Do the rest
-        if(P_len % 8 != 0){
-            int64_t rem = P_len - n_words*8; // Number of bytes left over
-            good &= *reinterpret_cast<const uint64_t*>(P + n_words*8) >> ((8 - rem)*8) == 
-                    *reinterpret_cast<const uint64_t*>(S + start + n_words*8) >> ((8 - rem)*8);
+    // Returns true iff some pattern occurs in text[0..len)
+    bool contains_any(const char* text, int64_t len) const {
+        for(int64_t p = 0; p < (int64_t)patterns.size(); p++){
+            if(for_each_occurrence(p, text, len, [](int64_t){return true;})) return true;
         }
-        n_matches += good;
+        return false;
+    }
+
+};
+
+// Returns the bases that an IUPAC degenerate code stands for, or nullptr if c is
+// not a degenerate code. A, C, G and T are not degenerate.
+inline const char* iupac_degenerate_bases(char c){
+    switch(c){
+        case 'R': case 'r': return "AG";
+        case 'Y': case 'y': return "CT";
+        case 'S': case 's': return "CG";
+        case 'W': case 'w': return "AT";
+        case 'K': case 'k': return "GT";
+        case 'M': case 'm': return "AC";
+        case 'B': case 'b': return "CGT";
+        case 'D': case 'd': return "AGT";
+        case 'H': case 'h': return "ACT";
+        case 'V': case 'v': return "ACG";
+        case 'N': case 'n': return "ACGT";
+        default: return nullptr;
     }
-    return n_matches;
 }
+
+// Approximate matcher that finds the occurrences of the patterns within edit
+// distance k, using Myers' bit-vector algorithm: the column of the dynamic
+// programming matrix of one pattern is kept in 64-bit words, so patterns can be
+// at most 64 characters long. With AVX2, four patterns are processed at once, one
+// per 64-bit lane. For k > 0, each end position where the distance drops to at
+// most k starts a run that lasts while it stays at most k, and one match is
+// reported per run, at the first position of its smallest distance, so that one
+// occurrence is not counted at every shifted end position. For k = 0, every end
+// position with distance 0 is a match, so overlapping occurrences are counted
+// like the exact matchers count them. Case insensitive like the Aho-Corasick
+// automata, and reports the matches in the same order. Empty patterns never match.
+// A degenerate IUPAC code in a pattern matches each of its bases and the code
+// itself. The code only sets more bits in the character tables, so with k = 0 this
+// is an exact matcher for degenerate patterns whose size does not depend on the
+// number of strings that the patterns expand to.
+class Myers_Matcher{
+
+private:
+
+    static constexpr int64_t lanes = 4;
+    static constexpr int64_t disabled_score = int64_t(1) << 40; // Score of the unused lanes of the last group
+
+    int64_t k;
+    vector<string> patterns; // Lower-cased non-empty patterns
+    vector<uint32_t> pattern_ids; // Indices of the non-empty patterns in the input
+    int64_t n_groups = 0;
+    vector<uint64_t> peq; // peq[(g * 256 + c) * lanes + l] = bit vector of the positions of c in pattern g * lanes + l
+    vector<uint64_t> initial_pv; // Per lane: the lowest m bits set
+    vector<uint64_t> high_bit; // Per lane: bit m - 1
+    vector<uint64_t> high_shift; // Per lane: m - 1
+    vector<int64_t> initial_score; // Per lane: m
+    bool use_avx2;
+
+    // Tracks the runs of end positions with distance at most k for one lane
+    struct Run{
+        int64_t best_score = disabled_score;
+        int64_t best_end = -1;
+    };
+
+    // Updates the run of a lane with the distance at end position j. Returns true
+    // and sets end if a run ended at j - 1, or with k = 0, if j is a match.
+    bool update_run(Run& run, int64_t score, int64_t j, int64_t& end) const {
+        if(k == 0 && score == 0){
+            end = j;
+            return true;
+        }
+        if(score <= k){
+            if(score < run.best_score){
+                run.best_score = score;
+                run.best_end = j;
+            }
+            return false;
+        }
+        if(run.best_end == -1) return false;
+        end = run.best_end;
+        run = Run();
+        return true;
+    }
+
+    // Calls report(p, end_pos) for the matches of the patterns of group g. Stops
+    // early and returns true if report returns true.
+    template<typename Report>
+    bool search_group_scalar(int64_t g, const char* text, int64_t len, Report&& report) const {
+        for(int64_t l = 0; l < lanes; l++){
+            int64_t p = g * lanes + l;
+            if(p >= (int64_t)patterns.size()) break;
+            uint64_t Pv = initial_pv[p], Mv = 0, high = high_bit[p];
+            int64_t score = initial_score[p];
+            Run run;
+            int64_t end;
+            for(int64_t j = 0; j < len; j++){
+                uint64_t Eq = peq[(g * 256 + (unsigned char)text[j]) * lanes + l];
+                uint64_t Xv = Eq | Mv;
+                uint64_t Xh = (((Eq & Pv) + Pv) ^ Pv) | Eq;
+                uint64_t Ph = Mv | ~(Xh | Pv);
+                uint64_t Mh = Pv & Xh;
+                score += ((Ph & high) != 0) - ((Mh & high) != 0);
+                Ph <<= 1;
+                Mh <<= 1;
+                Pv = Mh | ~(Xv | Ph);
+                Mv = Ph & Xv;
+                if(update_run(run, score, j, end) && report(p, end)) return true;
+            }
+            if(run.best_end != -1 && report(p, run.best_end)) return true;
+        }
+        return false;
+    }
+
+    template<typename Report>
+    __attribute__((target("avx2")))
+    bool search_group_avx2(int64_t g, const char* text, int64_t len, Report&& report) const {
+        __m256i Pv = _mm256_loadu_si256((const __m256i*)(initial_pv.data() + g * lanes));
+        __m256i Mv = _mm256_setzero_si256();
+        __m256i high = _mm256_loadu_si256((const __m256i*)(high_bit.data() + g * lanes));
+        __m256i shift = _mm256_loadu_si256((const __m256i*)(high_shift.data() + g * lanes));
+        __m256i score = _mm256_loadu_si256((const __m256i*)(initial_score.data() + g * lanes));
+        __m256i k_plus_one = _mm256_set1_epi64x(k + 1);
+        __m256i ones = _mm256_set1_epi64x(-1);
+        const uint64_t* group_peq = peq.data() + g * 256 * lanes;
+        Run runs[lanes];
+        int in_run = 0; // Bit l is set if lane l is in a run
+        int64_t end;
+        for(int64_t j = 0; j < len; j++){
+            __m256i Eq = _mm256_loadu_si256((const __m256i*)(group_peq + (unsigned char)text[j] * lanes));
+            __m256i Xv = _mm256_or_si256(Eq, Mv);
+            __m256i Xh = _mm256_or_si256(_mm256_xor_si256(_mm256_add_epi64(_mm256_and_si256(Eq, Pv), Pv), Pv), Eq);
+            __m256i Ph = _mm256_or_si256(Mv, _mm256_xor_si256(_mm256_or_si256(Xh, Pv), ones));
+            __m256i Mh = _mm256_and_si256(Pv, Xh);
+            score = _mm256_add_epi64(score, _mm256_srlv_epi64(_mm256_and_si256(Ph, high), shift));
+            score = _mm256_sub_epi64(score, _mm256_srlv_epi64(_mm256_and_si256(Mh, high), shift));
+            Ph = _mm256_slli_epi64(Ph, 1);
+            Mh = _mm256_slli_epi64(Mh, 1);
+            Pv = _mm256_or_si256(Mh, _mm256_xor_si256(_mm256_or_si256(Xv, Ph), ones));
+            Mv = _mm256_and_si256(Ph, Xv);
+            int hits = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k_plus_one, score)));
+            if((hits | in_run) == 0) continue;
+
+            // Some lane starts, continues or ends a run
+            int64_t scores[lanes];
+            _mm256_storeu_si256((__m256i*)scores, score);
+            for(int64_t l = 0; l < lanes; l++){
+                if(update_run(runs[l], scores[l], j, end) && report(g * lanes + l, end)) return true;
+            }
+            in_run = hits;
+        }
+        for(int64_t l = 0; l < lanes; l++){
+            if(runs[l].best_end != -1 && report(g * lanes + l, runs[l].best_end)) return true;
+        }
+        return false;
+    }
+
+    template<typename Report>
+    bool for_each_match(const char* text, int64_t len, Report&& report) const {
+        for(int64_t g = 0; g < n_groups; g++){
+            if(use_avx2 ? search_group_avx2(g, text, len, report) : search_group_scalar(g, text, len, report)) return true;
+        }
+        return false;
+    }
+
+public:
+
+    static constexpr int64_t max_pattern_length = 64;
+
+    // Returns true if all patterns fit in a 64-bit word and are longer than k
+    static bool supports(const vector<string>& patterns, int64_t k){
+        for(const string& P : patterns) if((int64_t)P.size() > max_pattern_length || (!P.empty() && (int64_t)P.size() <= k)) return false;
+        return true;
+    }
+
+    Myers_Matcher(const vector<string>& patterns, int64_t k) : k(k), use_avx2(__builtin_cpu_supports("avx2")) {
+        if(!supports(patterns, k)) throw std::invalid_argument("The Myers matcher needs patterns of length at most 64 and longer than the edit distance");
+        for(int64_t i = 0; i < (int64_t)patterns.size(); i++){
+            if(patterns[i].empty()) continue;
+            string P = patterns[i];
+            for(char& c : P) c = to_lower_ascii(c);
+            this->patterns.push_back(P);
+            pattern_ids.push_back(i);
+        }
+        n_groups = (this->patterns.size() + lanes - 1) / lanes;
+        peq.resize(n_groups * 256 * lanes);
+        initial_pv.resize(n_groups * lanes);
+        high_bit.resize(n_groups * lanes);
+        high_shift.resize(n_groups * lanes);
+        initial_score.resize(n_groups * lanes, disabled_score);
+        for(int64_t p = 0; p < (int64_t)this->patterns.size(); p++){
+            const string& P = this->patterns[p];
+            int64_t m = P.size();
+            int64_t g = p / lanes, l = p % lanes;
+            for(int64_t i = 0; i < m; i++){
+                unsigned char c = P[i];
+                peq[(g * 256 + c) * lanes + l] |= uint64_t(1) << i;
+                if(c >= 'a' && c <= 'z') peq[(g * 256 + (c ^ 0x20)) * lanes + l] |= uint64_t(1) << i;
+                const char* bases = iupac_degenerate_bases(c);
+                for(; bases != nullptr && *bases != 0; bases++){
+                    peq[(g * 256 + (unsigned char)*bases) * lanes + l] |= uint64_t(1) << i;
+                    peq[(g * 256 + (unsigned char)to_lower_ascii(*bases)) * lanes + l] |= uint64_t(1) << i;
+                }
+            }
+            initial_pv[p] = (m == 64) ? ~uint64_t(0) : (uint64_t(1) << m) - 1;
+            high_bit[p] = uint64_t(1) << (m - 1);
+            high_shift[p] = m - 1;
+            initial_score[p] = m;
+        }
+    }
+
+    int64_t get_k() const {return k;}
+
+    // Size of the bit vectors in bytes
+    int64_t size() const {return peq.size() * sizeof(uint64_t);}
+
+    // Calls visit(pattern_index, end_pos) for every match in text[0..len), in the
+    // same order as the automata.
+    template<typename Visitor>
+    void scan(const char* text, int64_t len, Visitor&& visit) const {
+        thread_local vector<Pattern_Match> matches;
+        matches.clear();
+        for_each_match(text, len, [&](int64_t p, int64_t end){
+            matches.push_back({end, (uint32_t)p});
+            return false;
+        });
+        sort_in_automaton_order(matches, patterns);
+        for(const Pattern_Match& m : matches) visit(pattern_ids[m.pattern], m.end);
+    }
+
+    // Returns true iff some pattern occurs in text[0..len) within edit distance k
+    bool contains_any(const char* text, int64_t len) const {
+        return for_each_match(text, len, [](int64_t, int64_t){return true;});
+    }
+
+};